@@ -16,7 +16,8 @@ var ext    = require('../lib/bson_ext'),
       'regexp'    : /foobar/i,
       'string'    : 'hello',
       'undefined' : undefined
-    });
+    }),
+    pureData = data.toString('binary');
 
 console.log('Decoding test:');
 
@@ -31,7 +32,7 @@ console.log("Addon completed in " + ((new Date().getTime() - startAddon)/1000) +
 var startPure = new Date().getTime();
 
 for (i=0; i<100000; i++) {
-  pure.decode(data);
+  pure.decode(pureData);
 }
 
 console.log("Pure completed in " + ((new Date().getTime() - startPure)/1000) + " seconds.");
\ No newline at end of file
@@ -22,6 +22,12 @@ for (i=0; i<iter; i++) {
 
 sys.puts("Pure finished in " + ((new Date().getTime() - startPure)/1000) + " seconds.");
 
+startAddon = new Date().getTime();
+
+ext.ObjectID.generateBatch(iter);
+
+sys.puts("Addon batch finished in " + ((new Date().getTime() - startAddon)/1000) + " seconds.");
+
 sys.puts("------------------------------")
 sys.puts("Generating OIDs from hex strings:");
 
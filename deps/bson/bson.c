@@ -2,6 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifdef __GNUC__
 #define INLINE static __inline__
@@ -9,11 +17,6 @@
 #define INLINE static
 #endif
 
-size_t strnlen (const char *string, size_t maxlen) {
-  const char *end = memchr (string, '\0', maxlen);
-  return end ? (size_t) (end - string) : maxlen;
-}
-
 static const int initialBufferSize = 128;
 static const int zero = 0;
 
@@ -78,64 +81,137 @@ INLINE void bson_swap_endian32(void *outp, const void *inp) {
 
 /** ObjectID **/
 
-static char hexbyte(char hex) {
-    switch (hex) {
-        case '0': return 0x0;
-        case '1': return 0x1;
-        case '2': return 0x2;
-        case '3': return 0x3;
-        case '4': return 0x4;
-        case '5': return 0x5;
-        case '6': return 0x6;
-        case '7': return 0x7;
-        case '8': return 0x8;
-        case '9': return 0x9;
-        case 'a':
-        case 'A': return 0xa;
-        case 'b':
-        case 'B': return 0xb;
-        case 'c':
-        case 'C': return 0xc;
-        case 'd':
-        case 'D': return 0xd;
-        case 'e':
-        case 'E': return 0xe;
-        case 'f':
-        case 'F': return 0xf;
-        default: return 0x0; /* something smarter? */
-    }
-}
-
-void bson_oid_from_string(bson_oid_t *oid, const char *str) {
-    int i;
+/* The value of each hex digit, or -1 for any other character */
+static const signed char hex_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+#define HEX_ROW(h) \
+    {h,'0'}, {h,'1'}, {h,'2'}, {h,'3'}, {h,'4'}, {h,'5'}, {h,'6'}, {h,'7'}, \
+    {h,'8'}, {h,'9'}, {h,'a'}, {h,'b'}, {h,'c'}, {h,'d'}, {h,'e'}, {h,'f'}
+
+/* The two hex digits of every byte, so encoding is one lookup per byte */
+static const char hex_pairs[256][2] = {
+    HEX_ROW('0'), HEX_ROW('1'), HEX_ROW('2'), HEX_ROW('3'),
+    HEX_ROW('4'), HEX_ROW('5'), HEX_ROW('6'), HEX_ROW('7'),
+    HEX_ROW('8'), HEX_ROW('9'), HEX_ROW('a'), HEX_ROW('b'),
+    HEX_ROW('c'), HEX_ROW('d'), HEX_ROW('e'), HEX_ROW('f')
+};
+
+#undef HEX_ROW
+
+/* Returns 0, leaving oid undefined, if any of the 24 characters is not a hex
+ * digit */
+int bson_oid_from_string(bson_oid_t *oid, const char *str) {
+    const unsigned char *in = (const unsigned char *)str;
+    int i, hi, lo, bad = 0;
     for (i=0; i<12; i++) {
-        oid->bytes[i] = (hexbyte(str[2*i]) << 4) | hexbyte(str[2*i + 1]);
+        hi = hex_values[in[2*i]];
+        lo = hex_values[in[2*i + 1]];
+        bad |= hi | lo;
+        oid->bytes[i] = (char)(((hi & 0xf) << 4) | (lo & 0xf));
     }
+    return bad >= 0;
 }
 void bson_oid_to_string(const bson_oid_t *oid, char *str) {
-    static const char hex[16] = {'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f'};
     int i;
     for (i=0; i<12; i++) {
-        str[2*i]     = hex[(oid->bytes[i] & 0xf0) >> 4];
-        str[2*i + 1] = hex[ oid->bytes[i] & 0x0f      ];
+        memcpy(str + 2*i, hex_pairs[(unsigned char)oid->bytes[i]], 2);
     }
     str[24] = '\0';
 }
-void bson_oid_gen(bson_oid_t *oid) {
-    static int incr = 0;
-    static int fuzz = 0;
-    int i = incr++; /* TODO make atomic */
-    int t = time(NULL);
+#ifdef __GNUC__
+#define BSON_FETCH_ADD(p, n) __sync_fetch_and_add(p, n)
+#define BSON_CAS(p, old, new) __sync_bool_compare_and_swap(p, old, new)
+#else
+#define BSON_FETCH_ADD(p, n) ((*(p) += (n)) - (n))
+#define BSON_CAS(p, old, new) (*(p) == (old) ? (*(p) = (new), 1) : 0)
+#endif
 
-    /* TODO rand sucks. find something better */
-    if (!fuzz) {
-        srand(t);
-        fuzz = rand();
+/* Three random bytes standing in for the machine, two of the pid and the
+ * counter's starting point. Random bytes come from /dev/urandom, so processes
+ * started in the same second on the same host do not collide. */
+static unsigned char oid_machine[5];
+static unsigned int oid_counter;
+/* 0 until seeded, 1 while a caller seeds, 2 once seeded */
+static int oid_seeded = 0;
+
+static void bson_oid_seed(void) {
+    unsigned char seed[6];
+    unsigned int mix, pid = 0;
+    FILE *urandom = fopen("/dev/urandom", "rb");
+    int i;
+
+#if defined(__unix__) || defined(__APPLE__)
+    pid = (unsigned int)getpid();
+#endif
+    if (!urandom || fread(seed, 1, 6, urandom) != 6) {
+        mix = (unsigned int)time(NULL) ^ (pid << 16) ^ (unsigned int)(size_t)seed;
+        for (i = 0; i < 6; i++) {
+            mix = mix * 1103515245u + 12345u;
+            seed[i] = (unsigned char)(mix >> 16);
+        }
     }
+    if (urandom) fclose(urandom);
 
-    bson_big_endian32(&oid->ints[0], &t);
-    oid->ints[1] = fuzz;
-    bson_big_endian32(&oid->ints[2], &i);
+    memcpy(oid_machine, seed, 3);
+    oid_machine[3] = (unsigned char)(pid >> 8);
+    oid_machine[4] = (unsigned char)pid;
+    oid_counter = (seed[3] << 16) | (seed[4] << 8) | seed[5];
+}
+
+/* Seeds exactly once however many threads get here first; the others wait
+ * for it rather than read a half-written machine id */
+static void bson_oid_seed_once(void) {
+    while (BSON_FETCH_ADD(&oid_seeded, 0) != 2) {
+        if (BSON_CAS(&oid_seeded, 0, 1)) {
+            bson_oid_seed();
+            BSON_CAS(&oid_seeded, 1, 2);
+        }
+    }
+}
+
+void bson_oid_gen(bson_oid_t *oid) {
+    bson_oid_gen_batch(oid, 1, time(NULL));
+}
+
+/* Claims count counter values with a single atomic add, so concurrent
+ * callers never share one. The counter is 24 bits and wraps, hence the cap
+ * on count. */
+void bson_oid_gen_batch(bson_oid_t *oids, int count, time_t seconds) {
+    unsigned char *b = (unsigned char *)oids;
+    unsigned int t = (unsigned int)seconds, i;
+    int n;
+
+    if (count <= 0) return;
+    bson_oid_seed_once();
+    i = BSON_FETCH_ADD(&oid_counter, (unsigned int)count);
+
+    for (n = 0; n < count; n++, i++, b += 12) {
+        b[0] = (unsigned char)(t >> 24);
+        b[1] = (unsigned char)(t >> 16);
+        b[2] = (unsigned char)(t >> 8);
+        b[3] = (unsigned char)t;
+        memcpy(b + 4, oid_machine, 5);
+        b[9] = (unsigned char)(i >> 16);
+        b[10] = (unsigned char)(i >> 8);
+        b[11] = (unsigned char)i;
+    }
 }
 
 time_t bson_oid_generated_time(bson_oid_t* oid) {
@@ -144,12 +220,92 @@ time_t bson_oid_generated_time(bson_oid_t* oid) {
     return out;
 }
 
+/** Scanning **/
+
+/* Like strnlen, but compares a vector of bytes at a time where the compiler
+ * targets SSE2 or AVX2. Never reads past maxlen. */
+static int bson_scan_nul(const char *s, int maxlen) {
+    const char *end;
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i nul32 = _mm256_setzero_si256();
+    unsigned mask32;
+    for (; i + 32 <= maxlen; i += 32) {
+        mask32 = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), nul32));
+        if (mask32) return i + __builtin_ctz(mask32);
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        const __m128i nul16 = _mm_setzero_si128();
+        unsigned mask16;
+        for (; i + 16 <= maxlen; i += 16) {
+            mask16 = (unsigned)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), nul16));
+            if (mask16) return i + __builtin_ctz(mask16);
+        }
+    }
+#endif
+    if (i >= maxlen) return maxlen;
+    end = memchr(s + i, '\0', maxlen - i);
+    return end ? (int)(end - s) : maxlen;
+}
+
+/* Returns 1 if the len bytes at s are well-formed UTF-8, rejecting overlong
+ * forms, surrogates and code points past U+10FFFF. Runs of ASCII are skipped
+ * a vector at a time. */
+static int bson_valid_utf8(const char *str, int len) {
+    const unsigned char *s = (const unsigned char *)str;
+    unsigned char c, lo, hi;
+    int i = 0, n, k;
+
+    for (;;) {
+#if defined(__AVX2__)
+        while (i + 32 <= len
+                && !_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)))) {
+            i += 32;
+        }
+#endif
+#if defined(__SSE2__)
+        while (i + 16 <= len
+                && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)))) {
+            i += 16;
+        }
+#endif
+        while (i < len && s[i] < 0x80) i++;
+        if (i == len) return 1;
+
+        c = s[i];
+        if (c < 0xc2) return 0; /* stray continuation byte or overlong lead */
+        else if (c < 0xe0) n = 1;
+        else if (c < 0xf0) n = 2;
+        else if (c < 0xf5) n = 3;
+        else return 0;
+        if (len - i <= n) return 0;
+
+        /* Only the second byte's range depends on the lead byte */
+        lo = 0x80;
+        hi = 0xbf;
+        if (c == 0xe0) lo = 0xa0;
+        else if (c == 0xed) hi = 0x9f;
+        else if (c == 0xf0) lo = 0x90;
+        else if (c == 0xf4) hi = 0x8f;
+        if (s[i + 1] < lo || s[i + 1] > hi) return 0;
+        for (k = 2; k <= n; k++) {
+            if ((s[i + k] & 0xc0) != 0x80) return 0;
+        }
+        i += n + 1;
+    }
+}
+
 /** Parser **/
 
 typedef enum {
     bson_state_document_start = 0,
     bson_state_array_start,
     bson_state_element_list,
+    bson_state_single_element,
     bson_state_parse_complete,
     bson_state_parse_error
 } bson_parser_state;
@@ -162,6 +318,20 @@ bson_parser bson_init_parser(const char *buf, int buflen, const bson_parser_call
     parser.remain = buflen;
     parser.callbacks = callbacks;
     parser.ctx = ctx;
+    parser.trusted = 0;
+    return parser;
+}
+
+void bson_parser_reset(bson_parser *parser, const char *buf, int buflen) {
+    parser->stackPos = 0;
+    parser->stack[0] = bson_state_document_start;
+    parser->cur = buf;
+    parser->remain = buflen;
+}
+
+bson_parser bson_init_element_parser(const char *element, int len, const bson_parser_callbacks *callbacks, void *ctx) {
+    bson_parser parser = bson_init_parser(element, len, callbacks, ctx);
+    parser.stack[0] = bson_state_single_element;
     return parser;
 }
 
@@ -191,9 +361,232 @@ bson_oid_t *bson_parse_oid(const char *cur) {
     return (bson_oid_t*)cur;
 }
 
+/* Returns the size of the value of an element of the given type starting at
+ * cur, or -1 if it is malformed or does not fit in remain bytes. */
+int bson_value_size(bson_type type, const char *cur, int remain) {
+    int size, len;
+
+    switch (type) {
+        case bson_undefined:
+        case bson_null:
+        case bson_min_key:
+        case bson_max_key:
+            return 0;
+        case bson_bool:
+            size = 1;
+            break;
+        case bson_int:
+            size = 4;
+            break;
+        case bson_double:
+        case bson_date:
+        case bson_timestamp:
+        case bson_long:
+            size = 8;
+            break;
+        case bson_oid:
+            size = 12;
+            break;
+        case bson_string:
+        case bson_code:
+        case bson_symbol:
+            if (remain < 4) return -1;
+            len = bson_parse_integer_32(cur);
+            if (len < 1) return -1;
+            size = 4 + len;
+            break;
+        case bson_bindata:
+            if (remain < 5) return -1;
+            len = bson_parse_integer_32(cur);
+            if (len < 0) return -1;
+            size = 4 + 1 + len;
+            break;
+        case bson_object:
+        case bson_array:
+            if (remain < 5) return -1;
+            size = bson_parse_integer_32(cur);
+            if (size < 5) return -1;
+            break;
+        case bson_codewscope:
+            if (remain < 4) return -1;
+            size = bson_parse_integer_32(cur);
+            if (size < 4 + 4 + 1 + 5) return -1;
+            break;
+        case bson_dbref:
+            if (remain < 4) return -1;
+            len = bson_parse_integer_32(cur);
+            if (len < 1) return -1;
+            size = 4 + len + 12;
+            break;
+        case bson_regex:
+            len = bson_scan_nul(cur, remain);
+            if (len == remain) return -1;
+            size = len + 1;
+            len = bson_scan_nul(cur + size, remain - size);
+            if (len == remain - size) return -1;
+            size += len + 1;
+            break;
+        default:
+            return -1;
+    }
+    return (size < 0 || size > remain) ? -1 : size;
+}
+
+/* Counts the elements of the document or array starting at doc, or returns
+ * -1 if its element list is malformed. */
+int bson_count_elements(const char *doc, int remain) {
+    const char *cur = doc + 4;
+    int count = 0, klen, vlen;
+    bson_type type;
+
+    if (remain < 5) return -1;
+    remain -= 4;
+    while (remain > 0) {
+        type = (bson_type)cur[0];
+        cur += 1;
+        remain -= 1;
+        if (type == bson_eoo) return count;
+        klen = bson_scan_nul(cur, remain);
+        if (klen == remain) return -1;
+        cur += klen + 1;
+        remain -= klen + 1;
+        vlen = bson_value_size(type, cur, remain);
+        if (vlen < 0) return -1;
+        cur += vlen;
+        remain -= vlen;
+        count++;
+    }
+    return -1;
+}
+
+/* Calls cb with each element name of the document at doc, in order, until it
+ * returns 0. Returns the number of elements, or -1 if cb stopped early or the
+ * document is malformed within remain bytes. */
+int bson_each_key(const char *doc, int remain, bson_key_callback cb, void *ctx) {
+    const char *cur = doc + 4;
+    int count = 0, klen, vlen;
+    bson_type type;
+
+    if (remain < 5) return -1;
+    remain -= 4;
+    while (remain > 0) {
+        type = (bson_type)cur[0];
+        cur += 1;
+        remain -= 1;
+        if (type == bson_eoo) return count;
+        klen = bson_scan_nul(cur, remain);
+        if (klen == remain) return -1;
+        if (!cb(ctx, cur, klen)) return -1;
+        cur += klen + 1;
+        remain -= klen + 1;
+        vlen = bson_value_size(type, cur, remain);
+        if (vlen < 0) return -1;
+        cur += vlen;
+        remain -= vlen;
+        count++;
+    }
+    return -1;
+}
+
+typedef struct {
+    char *keys;
+    int capacity;
+    int length;
+    int count;
+    unsigned long hash;
+} bson_shape_state;
+
+/* Index-like names become array elements and __proto__ is no ordinary
+ * property, so a document with either has no shape */
+static int bson_shape_key(void *ctx, const char *name, int length) {
+    bson_shape_state *s = (bson_shape_state *)ctx;
+    int i;
+
+    if ((name[0] >= '0' && name[0] <= '9') || ++s->count > BSON_SHAPE_MAX_KEYS
+            || length + 1 > s->capacity - s->length
+            || (length == 9 && memcmp(name, "__proto__", 9) == 0)) {
+        return 0;
+    }
+    for (i = 0; i <= length; i++) {
+        s->hash = ((s->hash ^ (unsigned char)name[i]) * 16777619UL) & 0xffffffffUL;
+    }
+    memcpy(s->keys + s->length, name, length + 1);
+    s->length += length + 1;
+    return 1;
+}
+
+int bson_shape_keys(const char *doc, int remain, char *keys, int capacity, unsigned int *hash) {
+    bson_shape_state s;
+    s.keys = keys;
+    s.capacity = capacity;
+    s.length = 0;
+    s.count = 0;
+    s.hash = 2166136261UL;
+
+    if (bson_each_key(doc, remain, bson_shape_key, &s) <= 0) return -1;
+    *hash = (unsigned int)s.hash;
+    return s.length;
+}
+
+/* Finds the element at a dotted path such as "a.b.0.c" by skipping over the
+ * values of every other element. Returns 1 and sets element and length if it
+ * is found, 0 if it is not, or -1 if the document is malformed. */
+int bson_find(const char *doc, int remain, const char *path, const char **element, int *length) {
+    const char *cur, *start, *name, *next;
+    int doclen, seglen, klen, vlen;
+    bson_type type;
+
+    for (;;) {
+        if (remain < 5) return -1;
+        doclen = bson_parse_integer_32(doc);
+        if (doclen < 5 || doclen > remain) return -1;
+        cur = doc + 4;
+        remain = doclen - 4;
+        next = strchr(path, '.');
+        seglen = next ? next - path : (int)strlen(path);
+
+        for (;;) {
+            if (remain < 1) return -1;
+            start = cur;
+            type = (bson_type)cur[0];
+            cur += 1;
+            remain -= 1;
+            if (type == bson_eoo) return 0;
+
+            klen = bson_scan_nul(cur, remain);
+            if (klen == remain) return -1;
+            name = cur;
+            cur += klen + 1;
+            remain -= klen + 1;
+
+            vlen = bson_value_size(type, cur, remain);
+            if (vlen < 0) return -1;
+
+            if (klen == seglen && memcmp(name, path, seglen) == 0) break;
+            cur += vlen;
+            remain -= vlen;
+        }
+
+        if (!next) {
+            *element = start;
+            *length = cur + vlen - start;
+            return 1;
+        }
+        if (type != bson_object && type != bson_array) return 0;
+        doc = cur;
+        remain = vlen;
+        path = next + 1;
+    }
+}
+
+/* The content checks below compile away in the trusted copy of
+ * bson_parse_document. Bounds and lengths are checked in both copies, so
+ * trusted input that changed after it was validated can decode to wrong
+ * values but never read outside the document. */
 #define PARSE_ELEMENT_NAME \
-    klen = strnlen(parser->cur, parser->remain); \
+    klen = bson_scan_nul(parser->cur, parser->remain); \
     DECR_REMAIN(klen + 1); \
+    CHECK_UTF8(parser->cur, klen); \
     ename = parser->cur; \
     parser->cur += klen + 1;
 
@@ -204,35 +597,88 @@ bson_oid_t *bson_parse_oid(const char *cur) {
         break; \
     }
 
+#define CHECK_UTF8(s, len) \
+    if (!trusted && !bson_valid_utf8(s, len)) { \
+        parser->stack[parser->stackPos] = bson_state_parse_error; \
+        break; \
+    }
+
+/* A string value is elen - 1 bytes of UTF-8 followed by a NUL */
+#define CHECK_STRING(elen) \
+    if (elen < 1 || (!trusted && parser->cur[elen - 1] != '\0')) { \
+        parser->stack[parser->stackPos] = bson_state_parse_error; \
+        break; \
+    } \
+    CHECK_UTF8(parser->cur, elen - 1);
+
+/* A declared length that no well-formed value has; checked in both copies */
+#define CHECK_LENGTH(ok) \
+    if (!(ok)) { \
+        parser->stack[parser->stackPos] = bson_state_parse_error; \
+        break; \
+    }
+
+/* Checked before the start callback so callers can size their own stacks by
+ * BSON_PARSER_DEPTH */
+#define CHECK_DEPTH \
+    if (parser->stackPos + 1 >= BSON_PARSER_DEPTH) { \
+        parser->stack[parser->stackPos] = bson_state_parse_error; \
+        break; \
+    }
+
 #define CHECK_CB(x) \
     if (!(x)) { \
         parser->stack[parser->stackPos] = bson_state_parse_error; \
         return 0; \
     }
 
-int bson_parse(bson_parser *parser) {
+/* Always called with a constant trusted flag, so each call site gets its own
+ * copy with the checks folded away */
+#ifdef __GNUC__
+__attribute__((always_inline))
+#endif
+INLINE int bson_parse_document(bson_parser *parser, const int trusted) {
     start_token:
     switch (parser->stack[parser->stackPos]) {
         bson_type etype;
-        
+        char subtype;
+        const char *ename, *data, *supl;
+        int klen, elen, rlen;
+
         case bson_state_parse_error:
             return 0;
         case bson_state_parse_complete:
             return 1;
+        case bson_state_single_element:
+            /* Complete once the element and anything nested in it is parsed */
+            parser->stack[parser->stackPos] = bson_state_parse_complete;
+            goto parse_element;
         case bson_state_document_start:
         case bson_state_array_start:
             DECR_REMAIN(4);
             parser->cur += 4;
             parser->stack[parser->stackPos] = bson_state_element_list;
         case bson_state_element_list:
+        parse_element:
             DECR_REMAIN(1);
             etype = (bson_type)parser->cur[0];
             parser->cur += 1;
+            if (etype != bson_eoo) {
+                PARSE_ELEMENT_NAME;
+                if (parser->callbacks->bson_select
+                        && !parser->callbacks->bson_select(parser->ctx, ename, etype)) {
+                    /* Jump over the whole value, nested documents included */
+                    elen = bson_value_size(etype, parser->cur, parser->remain);
+                    if (elen < 0) {
+                        parser->stack[parser->stackPos] = bson_state_parse_error;
+                        break;
+                    }
+                    parser->cur += elen;
+                    parser->remain -= elen;
+                    break;
+                }
+            }
             switch (etype) {
-                char subtype;
-                const char *ename, *data, *supl;
-                int klen, elen, rlen;
-
                 case bson_eoo:
                     if (parser->callbacks->bson_end_document) {
                         CHECK_CB(parser->callbacks->bson_end_document(parser->ctx));
@@ -244,13 +690,11 @@ int bson_parse(bson_parser *parser) {
                     }
                     break;
                 case bson_null:
-                    PARSE_ELEMENT_NAME;
                     if (parser->callbacks->bson_null) {
                         CHECK_CB(parser->callbacks->bson_null(parser->ctx, ename));
                     }
                     break;
                 case bson_bool:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(1);
                     if (parser->callbacks->bson_boolean) {
                         CHECK_CB(parser->callbacks->bson_boolean(parser->ctx, ename, (int)parser->cur[0]));
@@ -258,7 +702,6 @@ int bson_parse(bson_parser *parser) {
                     parser->cur += 1;
                     break;
                 case bson_int:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(4);
                     if (parser->callbacks->bson_integer_32) {
                         CHECK_CB(parser->callbacks->bson_integer_32(parser->ctx, ename, bson_parse_integer_32(parser->cur)));
@@ -266,7 +709,6 @@ int bson_parse(bson_parser *parser) {
                     parser->cur += 4;
                     break;
                 case bson_long:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(8);
                     if (parser->callbacks->bson_integer_64) {
                         CHECK_CB(parser->callbacks->bson_integer_64(parser->ctx, ename, bson_parse_integer_64(parser->cur)));
@@ -274,7 +716,6 @@ int bson_parse(bson_parser *parser) {
                     parser->cur += 8;
                     break;
                 case bson_double:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(8);
                     if (parser->callbacks->bson_float) {
                         CHECK_CB(parser->callbacks->bson_float(parser->ctx, ename, bson_parse_double(parser->cur)));
@@ -282,7 +723,6 @@ int bson_parse(bson_parser *parser) {
                     parser->cur += 8;
                     break;
                 case bson_date:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(8);
                     if (parser->callbacks->bson_datetime) {
                         CHECK_CB(parser->callbacks->bson_datetime(parser->ctx, ename, bson_parse_date(parser->cur)));
@@ -290,7 +730,6 @@ int bson_parse(bson_parser *parser) {
                     parser->cur += 8;
                     break;
                 case bson_oid:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(12);
                     if (parser->callbacks->bson_objectid) {
                         CHECK_CB(parser->callbacks->bson_objectid(parser->ctx, ename, bson_parse_oid(parser->cur)));
@@ -298,41 +737,43 @@ int bson_parse(bson_parser *parser) {
                     parser->cur += 12;
                     break;
                 case bson_string:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(4);
                     elen = bson_parse_integer_32(parser->cur);
                     parser->cur += 4;
                     DECR_REMAIN(elen);
+                    CHECK_STRING(elen);
                     if (parser->callbacks->bson_string) {
                         CHECK_CB(parser->callbacks->bson_string(parser->ctx, ename, parser->cur, elen - 1));
                     }
                     parser->cur += elen;
                     break;
                 case bson_code:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(4);
                     elen = bson_parse_integer_32(parser->cur);
                     parser->cur += 4;
                     DECR_REMAIN(elen);
+                    CHECK_STRING(elen);
                     if (parser->callbacks->bson_code) {
                         CHECK_CB(parser->callbacks->bson_code(parser->ctx, ename, parser->cur, elen - 1));
                     }
                     parser->cur += elen;
                     break;
                 case bson_bindata:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(5);
                     elen = bson_parse_integer_32(parser->cur);
                     parser->cur += 4;
                     subtype = parser->cur[0];
                     parser->cur += 1;
+                    CHECK_LENGTH(elen >= 0);
                     DECR_REMAIN(elen);
 
-                    /* Handle binary subtype 2 */
+                    /* Binary subtype 2 repeats the length of its payload */
                     rlen = elen;
                     data = parser->cur;
                     if (subtype == 2) {
+                        CHECK_LENGTH(elen >= 4);
                         rlen = bson_parse_integer_32(parser->cur);
+                        CHECK_LENGTH(rlen == elen - 4);
                         data = parser->cur + 4;
                     }
 
@@ -342,28 +783,31 @@ int bson_parse(bson_parser *parser) {
                     parser->cur += elen;
                     break;
                 case bson_object:
-                    PARSE_ELEMENT_NAME;
+                    CHECK_DEPTH;
                     if (parser->callbacks->bson_start_document) {
-                        CHECK_CB(parser->callbacks->bson_start_document(parser->ctx, ename));
+                        CHECK_CB(parser->callbacks->bson_start_document(parser->ctx, ename,
+                            parser->cur, parser->remain));
                     }
                     parser->stackPos += 1;
                     parser->stack[parser->stackPos] = bson_state_document_start;
                     break;
                 case bson_array:
-                    PARSE_ELEMENT_NAME;
+                    CHECK_DEPTH;
                     if (parser->callbacks->bson_start_array) {
-                        CHECK_CB(parser->callbacks->bson_start_array(parser->ctx, ename));
+                        CHECK_CB(parser->callbacks->bson_start_array(parser->ctx, ename,
+                            bson_count_elements(parser->cur, parser->remain)));
                     }
                     parser->stackPos += 1;
                     parser->stack[parser->stackPos] = bson_state_array_start;
                     break;
                 case bson_codewscope:
-                    PARSE_ELEMENT_NAME;
+                    CHECK_DEPTH;
                     DECR_REMAIN(8);
                     parser->cur += 4;
                     elen = bson_parse_integer_32(parser->cur);
                     parser->cur += 4;
                     DECR_REMAIN(elen);
+                    CHECK_STRING(elen);
                     if (parser->callbacks->bson_code_w_scope) {
                         CHECK_CB(parser->callbacks->bson_code_w_scope(parser->ctx, ename, parser->cur, elen - 1));
                     }
@@ -372,15 +816,15 @@ int bson_parse(bson_parser *parser) {
                     parser->stack[parser->stackPos] = bson_state_document_start;
                     break;
                 case bson_regex:
-                    PARSE_ELEMENT_NAME;
-
-                    elen = strnlen(parser->cur, parser->remain);
+                    elen = bson_scan_nul(parser->cur, parser->remain);
                     DECR_REMAIN(elen + 1);
+                    CHECK_UTF8(parser->cur, elen);
                     data = parser->cur;
                     parser->cur += elen + 1;
 
-                    elen = strnlen(parser->cur, parser->remain);
+                    elen = bson_scan_nul(parser->cur, parser->remain);
                     DECR_REMAIN(elen + 1);
+                    CHECK_UTF8(parser->cur, elen);
                     supl = parser->cur;
                     parser->cur += elen + 1;
 
@@ -389,18 +833,17 @@ int bson_parse(bson_parser *parser) {
                     }
                     break;
                 case bson_symbol:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(4);
                     elen = bson_parse_integer_32(parser->cur);
                     parser->cur += 4;
                     DECR_REMAIN(elen);
+                    CHECK_STRING(elen);
                     if (parser->callbacks->bson_symbol) {
                         CHECK_CB(parser->callbacks->bson_symbol(parser->ctx, ename, parser->cur, elen - 1));
                     }
                     parser->cur += elen;
                     break;
                 case bson_timestamp:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(8);
                     elen = bson_parse_integer_32(parser->cur);
                     parser->cur += 4;
@@ -411,27 +854,24 @@ int bson_parse(bson_parser *parser) {
                     }
                     break;
                 case bson_undefined:
-                    PARSE_ELEMENT_NAME;
                     if (parser->callbacks->bson_undefined) {
                         CHECK_CB(parser->callbacks->bson_undefined(parser->ctx, ename));
                     }
                     break;
                 case bson_min_key:
-                    PARSE_ELEMENT_NAME;
                     if (parser->callbacks->bson_min_key) {
                         CHECK_CB(parser->callbacks->bson_min_key(parser->ctx, ename));
                     }
                     break;
                 case bson_max_key:
-                    PARSE_ELEMENT_NAME;
                     if (parser->callbacks->bson_max_key) {
                         CHECK_CB(parser->callbacks->bson_max_key(parser->ctx, ename));
                     }
                     break;
                 case bson_dbref:
-                    PARSE_ELEMENT_NAME;
                     DECR_REMAIN(4);
                     elen = bson_parse_integer_32(parser->cur);
+                    CHECK_LENGTH(elen >= 1);
                     DECR_REMAIN(elen + 12);
                     parser->cur += elen + 16;
                     break;
@@ -445,15 +885,375 @@ int bson_parse(bson_parser *parser) {
     goto start_token;
 }
 
+int bson_parse(bson_parser *parser) {
+    return parser->trusted ? bson_parse_document(parser, 1) : bson_parse_document(parser, 0);
+}
+
+/** Validation **/
+
+/* A string value: an int32 length, then that many bytes of UTF-8 whose last
+ * one is the NUL */
+static int bson_validate_string(const char *cur, int size) {
+    int len = bson_parse_integer_32(cur);
+    return len >= 1 && size == 4 + len && cur[3 + len] == '\0'
+        && bson_valid_utf8(cur + 4, len - 1);
+}
+
+/* Checks the document at doc, whose declared length must be exactly len, and
+ * everything nested in it. depth is the number of levels still allowed. */
+static int bson_validate_document(const char *doc, int len, int depth) {
+    const char *cur, *end;
+    int klen, vlen, slen;
+    bson_type type;
+
+    if (depth < 1 || len < 5 || bson_parse_integer_32(doc) != len || doc[len - 1] != '\0') {
+        return 0;
+    }
+    cur = doc + 4;
+    end = doc + len - 1;
+    while (cur < end) {
+        type = (bson_type)*cur++;
+        if (type == bson_eoo) return 0; /* terminated before its declared end */
+
+        klen = bson_scan_nul(cur, end - cur);
+        if (klen == end - cur || !bson_valid_utf8(cur, klen)) return 0;
+        cur += klen + 1;
+
+        vlen = bson_value_size(type, cur, end - cur);
+        if (vlen < 0) return 0;
+        switch (type) {
+            case bson_string:
+            case bson_code:
+            case bson_symbol:
+                if (!bson_validate_string(cur, vlen)) return 0;
+                break;
+            case bson_dbref:
+                if (!bson_validate_string(cur, vlen - 12)) return 0;
+                break;
+            case bson_object:
+            case bson_array:
+                if (!bson_validate_document(cur, vlen, depth - 1)) return 0;
+                break;
+            case bson_codewscope:
+                /* total length, code string, scope document */
+                slen = bson_parse_integer_32(cur + 4);
+                if (slen < 1 || slen > vlen - 8 - 5
+                        || !bson_validate_string(cur + 4, 4 + slen)
+                        || !bson_validate_document(cur + 8 + slen, vlen - 8 - slen, depth - 1)) {
+                    return 0;
+                }
+                break;
+            case bson_bindata:
+                /* the old binary subtype repeats the length of its payload */
+                if (cur[4] == 2 && (vlen < 9 || bson_parse_integer_32(cur + 5) != vlen - 9)) {
+                    return 0;
+                }
+                break;
+            case bson_regex:
+                klen = strlen(cur);
+                if (!bson_valid_utf8(cur, klen) || !bson_valid_utf8(cur + klen + 1, vlen - klen - 2)) {
+                    return 0;
+                }
+                break;
+            default:
+                break;
+        }
+        cur += vlen;
+    }
+    return 1;
+}
+
+int bson_validate(const char *doc, int remain, int maxDepth) {
+    int len;
+    if (remain < 5) return 0;
+    len = bson_parse_integer_32(doc);
+    if (len > remain) return 0;
+    if (maxDepth > BSON_PARSER_DEPTH) maxDepth = BSON_PARSER_DEPTH;
+    return bson_validate_document(doc, len, maxDepth);
+}
+
+/** Tape **/
+
+static bson_tape_entry *bson_tape_push(void *ctx, int type, const char *e_name) {
+    bson_tape *tape = (bson_tape *)ctx;
+    bson_tape_entry *e;
+
+    if (tape->count == tape->capacity) {
+        int capacity = tape->capacity ? tape->capacity * 2 : 64;
+        e = (bson_tape_entry *)realloc(tape->entries, capacity * sizeof(bson_tape_entry));
+        if (!e) return 0;
+        tape->entries = e;
+        tape->capacity = capacity;
+    }
+    e = &tape->entries[tape->count++];
+    e->type = type;
+    e->subtype = 0;
+    e->key = e_name ? e_name - tape->base : 0;
+    e->length = 0;
+    e->value.int64 = 0;
+    return e;
+}
+
+#define TAPE_PUSH(type) \
+    bson_tape_entry *e = bson_tape_push(ctx, type, e_name); \
+    if (!e) return 0;
+
+#define TAPE_OFFSET(ptr) (int)((ptr) - ((bson_tape *)ctx)->base)
+
+/* Records the shape of the document at doc in e, so the main thread can
+ * look it up without walking the document's names again */
+static int bson_tape_shape(bson_tape *tape, bson_tape_entry *e, const char *doc, int remain) {
+    int length;
+
+    if (tape->keysCapacity - tape->keysLength < BSON_SHAPE_MAX_BYTES) {
+        int capacity = tape->keysCapacity ? tape->keysCapacity * 2 : 4 * BSON_SHAPE_MAX_BYTES;
+        char *keys = (char *)realloc(tape->keys, capacity);
+        if (!keys) return 0;
+        tape->keys = keys;
+        tape->keysCapacity = capacity;
+    }
+    length = bson_shape_keys(doc, remain, tape->keys + tape->keysLength, BSON_SHAPE_MAX_BYTES,
+                             &e->value.shape.hash);
+    if (length < 0) {
+        e->length = 0;
+        e->value.shape.keys = -1;
+    } else {
+        e->length = length;
+        e->value.shape.keys = tape->keysLength;
+        tape->keysLength += length;
+    }
+    return 1;
+}
+
+static int bson_tape_start_document(void *ctx, const char *e_name, const char *doc, int remain) {
+    TAPE_PUSH(bson_object);
+    return bson_tape_shape((bson_tape *)ctx, e, doc, remain);
+}
+
+static int bson_tape_end_document(void *ctx) {
+    const char *e_name = 0;
+    TAPE_PUSH(bson_eoo);
+    return 1;
+}
+
+static int bson_tape_start_array(void *ctx, const char *e_name, int count) {
+    TAPE_PUSH(bson_array);
+    e->length = count;
+    return 1;
+}
+
+static int bson_tape_float(void *ctx, const char *e_name, double val) {
+    TAPE_PUSH(bson_double);
+    e->value.number = val;
+    return 1;
+}
+
+static int bson_tape_string(void *ctx, const char *e_name, const char *str, int length) {
+    TAPE_PUSH(bson_string);
+    e->value.offset = TAPE_OFFSET(str);
+    e->length = length;
+    return 1;
+}
+
+static int bson_tape_binary(void *ctx, const char *e_name, const char *data, unsigned char subtype, int length) {
+    TAPE_PUSH(bson_bindata);
+    e->value.offset = TAPE_OFFSET(data);
+    e->subtype = subtype;
+    e->length = length;
+    return 1;
+}
+
+static int bson_tape_undefined(void *ctx, const char *e_name) {
+    TAPE_PUSH(bson_undefined);
+    return 1;
+}
+
+static int bson_tape_objectid(void *ctx, const char *e_name, bson_oid_t *oid) {
+    TAPE_PUSH(bson_oid);
+    e->value.offset = TAPE_OFFSET(oid->bytes);
+    return 1;
+}
+
+static int bson_tape_boolean(void *ctx, const char *e_name, int val) {
+    TAPE_PUSH(bson_bool);
+    e->value.int32 = val;
+    return 1;
+}
+
+static int bson_tape_datetime(void *ctx, const char *e_name, int64_t date) {
+    TAPE_PUSH(bson_date);
+    e->value.int64 = date;
+    return 1;
+}
+
+static int bson_tape_null(void *ctx, const char *e_name) {
+    TAPE_PUSH(bson_null);
+    return 1;
+}
+
+static int bson_tape_regex(void *ctx, const char *e_name, const char *pattern, const char *options) {
+    TAPE_PUSH(bson_regex);
+    e->value.offset = TAPE_OFFSET(pattern);
+    e->length = options - pattern - 1;
+    return 1;
+}
+
+static int bson_tape_code(void *ctx, const char *e_name, const char *code, int length) {
+    TAPE_PUSH(bson_code);
+    e->value.offset = TAPE_OFFSET(code);
+    e->length = length;
+    return 1;
+}
+
+static int bson_tape_symbol(void *ctx, const char *e_name, const char *symbol, int length) {
+    TAPE_PUSH(bson_symbol);
+    e->value.offset = TAPE_OFFSET(symbol);
+    e->length = length;
+    return 1;
+}
+
+static int bson_tape_code_w_scope(void *ctx, const char *e_name, const char *code, int length) {
+    TAPE_PUSH(bson_codewscope);
+    e->value.offset = TAPE_OFFSET(code);
+    e->length = length;
+    return 1;
+}
+
+static int bson_tape_integer_32(void *ctx, const char *e_name, int val) {
+    TAPE_PUSH(bson_int);
+    e->value.int32 = val;
+    return 1;
+}
+
+static int bson_tape_timestamp(void *ctx, const char *e_name, int increment, int timestamp) {
+    TAPE_PUSH(bson_timestamp);
+    e->value.int64 = ((int64_t)(unsigned int)timestamp << 32) | (unsigned int)increment;
+    return 1;
+}
+
+static int bson_tape_integer_64(void *ctx, const char *e_name, int64_t val) {
+    TAPE_PUSH(bson_long);
+    e->value.int64 = val;
+    return 1;
+}
+
+static int bson_tape_min_key(void *ctx, const char *e_name) {
+    TAPE_PUSH(bson_min_key);
+    return 1;
+}
+
+static int bson_tape_max_key(void *ctx, const char *e_name) {
+    TAPE_PUSH(bson_max_key);
+    return 1;
+}
+
+static const bson_parser_callbacks bson_tape_callbacks = {
+    bson_tape_start_document,
+    bson_tape_end_document,
+    bson_tape_start_array,
+    0,
+    bson_tape_float,
+    bson_tape_string,
+    bson_tape_binary,
+    bson_tape_undefined,
+    bson_tape_objectid,
+    bson_tape_boolean,
+    bson_tape_datetime,
+    bson_tape_null,
+    bson_tape_regex,
+    bson_tape_code,
+    bson_tape_symbol,
+    bson_tape_code_w_scope,
+    bson_tape_integer_32,
+    bson_tape_timestamp,
+    bson_tape_integer_64,
+    bson_tape_min_key,
+    bson_tape_max_key,
+    0
+};
+
+int bson_tape_build(bson_tape *tape, const char *buf, int buflen) {
+    bson_parser parser;
+    tape->base = buf;
+    tape->entries = 0;
+    tape->count = 0;
+    tape->capacity = 0;
+    tape->keys = 0;
+    tape->keysLength = 0;
+    tape->keysCapacity = 0;
+    memset(&tape->root, 0, sizeof(tape->root));
+    tape->root.type = bson_object;
+    if (!bson_tape_shape(tape, &tape->root, buf, buflen)) return 0;
+    parser = bson_init_parser(buf, buflen, &bson_tape_callbacks, tape);
+    return bson_parse(&parser);
+}
+
+void bson_tape_destroy(bson_tape *tape) {
+    free(tape->entries);
+    free(tape->keys);
+    tape->entries = 0;
+    tape->count = 0;
+    tape->capacity = 0;
+    tape->keys = 0;
+    tape->keysLength = 0;
+    tape->keysCapacity = 0;
+}
+
 /** Generator **/
 
 bson_generator bson_init_generator() {
+    return bson_init_generator_size(initialBufferSize);
+}
+
+bson_generator bson_init_generator_size(int size) {
+    if (size < 5) size = 5;
+    return bson_init_generator_owned((char *)malloc(size), size);
+}
+
+bson_generator bson_init_generator_owned(char *buf, int bufSize) {
+    bson_generator g;
+    g.buf = buf;
+    g.bufSize = bufSize;
+    g.cur = g.buf + 4;
+    g.finished = 0;
+    g.fixed = 0;
+    g.start = 0;
+    g.error = g.buf ? bson_generator_ok : bson_generator_nomem;
+    g.stackPos = 0;
+    g.flush = 0;
+    return g;
+}
+
+bson_generator bson_init_generator_buffer(char *buf, int bufSize) {
     bson_generator g;
-    g.buf = (char *)malloc(initialBufferSize);
-    g.bufSize = initialBufferSize;
+    g.buf = buf;
+    g.bufSize = bufSize;
     g.cur = g.buf + 4;
     g.finished = 0;
+    g.fixed = 1;
+    g.start = 0;
+    g.error = bson_generator_ok;
     g.stackPos = 0;
+    g.flush = 0;
+    return g;
+}
+
+bson_generator bson_init_generator_stream(char *buf, int bufSize, const int *sizes, int sizeCount,
+                                          bson_generator_flush flush, void *ctx) {
+    bson_generator g = bson_init_generator_buffer(buf, bufSize);
+    g.cur = g.buf;
+    g.flush = flush;
+    g.flushCtx = ctx;
+    g.sizes = sizes;
+    g.sizeCount = sizeCount;
+    g.sizePos = 0;
+    g.flushed = 0;
+    if (sizeCount < 1 || bufSize < 16) {
+        g.error = sizeCount < 1 ? bson_generator_size_mismatch : bson_generator_overflow;
+    } else {
+        bson_little_endian32(g.cur, &sizes[g.sizePos++]);
+        g.cur += 4;
+    }
     return g;
 }
 
@@ -478,48 +1278,151 @@ void bson_append64(bson_generator *b, const void *data) {
     b->cur += 8;
 }
 
+/* Hands the buffered bytes of a streaming generator to its flush callback */
+static int bson_generator_flush_buffer(bson_generator *b) {
+    int len = b->cur - b->buf;
+    if (len == 0) return 1;
+    if (!b->flush(b->flushCtx, b->buf, len)) {
+        b->error = bson_generator_flush_failed;
+        return 0;
+    }
+    b->flushed += len;
+    b->cur = b->buf;
+    return 1;
+}
+
 int bson_ensure_space(bson_generator *b, const int bytesNeeded) {
     int pos = b->cur - b->buf;
-    char *orig = b->buf;
+    char *buf;
     int new_size;
 
-    if (b->finished) return 0;
+    if (b->finished || b->error) return 0;
     if (pos + bytesNeeded <= b->bufSize) return 1;
+    if (b->flush) {
+        if (!bson_generator_flush_buffer(b)) return 0;
+        if (bytesNeeded <= b->bufSize) return 1;
+        b->error = bson_generator_overflow;
+        return 0;
+    }
+    if (b->fixed) {
+        b->error = bson_generator_overflow;
+        return 0;
+    }
     new_size = 1.5 * (b->bufSize + bytesNeeded);
-    b->buf = realloc(b->buf, new_size);
-    if (!b->buf) return 0;
+    buf = realloc(b->buf, new_size);
+    if (!buf) {
+        b->error = bson_generator_nomem;
+        return 0;
+    }
+    b->buf = buf;
     b->bufSize = new_size;
-    b->cur += b->buf - orig;
+    b->cur = b->buf + pos;
     return 1;
 }
 
+/* Streaming position of the next byte */
+#define STREAM_POS(b) ((b)->flushed + ((b)->cur - (b)->buf))
+
 char *bson_generator_finish(bson_generator *b) {
     int i;
+    if (b->flush && !b->finished) {
+        if (!bson_ensure_space(b, 1)) return 0;
+        bson_append_byte(b, 0);
+        if (b->stackPos != 0 || b->sizePos != b->sizeCount || STREAM_POS(b) != b->sizes[0]) {
+            b->error = bson_generator_size_mismatch;
+            return 0;
+        }
+        if (!bson_generator_flush_buffer(b)) return 0;
+        b->finished = 1;
+    }
     if (!b->finished) {
         if (!bson_ensure_space(b, 1)) return 0;
         bson_append_byte(b, 0);
-        i = b->cur - b->buf;
-        bson_little_endian32(b->buf, &i);
+        i = b->cur - (b->buf + b->start);
+        bson_little_endian32(b->buf + b->start, &i);
         b->finished = 1;
     }
     return b->buf;
 }
 
+int bson_generator_next(bson_generator *b) {
+    if (!b->finished || b->error || b->flush) return 0;
+    b->finished = 0;
+    if (!bson_ensure_space(b, 5)) return 0;
+    b->start = b->cur - b->buf;
+    b->cur += 4;
+    b->stackPos = 0;
+    return 1;
+}
+
 void bson_generator_destroy(bson_generator *b) {
-    free(b->buf);
+    if (!b->fixed) free(b->buf);
     b->buf = 0;
     b->cur = 0;
     b->finished = 1;
 }
 
+/* Copies a payload for a streaming generator, flushing as needed. One that
+ * would not fit in an empty buffer goes straight to the flush callback in
+ * pieces of the buffer size, so no chunk is ever larger than the buffer. */
+static int bson_append_stream_payload(bson_generator *b, const void *data, int len) {
+    const char *cur = (const char *)data;
+    int n;
+    if (b->finished || b->error) return 0;
+    if (len > b->bufSize - (b->cur - b->buf)) {
+        if (!bson_generator_flush_buffer(b)) return 0;
+        while (len > b->bufSize) {
+            n = b->bufSize;
+            if (!b->flush(b->flushCtx, cur, n)) {
+                b->error = bson_generator_flush_failed;
+                return 0;
+            }
+            b->flushed += n;
+            cur += n;
+            len -= n;
+        }
+    }
+    bson_append(b, cur, len);
+    return 1;
+}
+
+/* Variable-length payloads are reserved together with their element header,
+ * except by streaming generators, which copy them separately */
+#define PAYLOAD_SIZE(b, len) ((b)->flush ? 0 : (len))
+
+INLINE int bson_append_payload(bson_generator *b, const void *data, int len) {
+    if (b->flush) return bson_append_stream_payload(b, data, len);
+    bson_append(b, data, len);
+    return 1;
+}
+
 INLINE int bson_append_estart(bson_generator *b, int type, const char *name, const int dataSize) {
     const int sl = strlen(name) + 1;
+    if (b->flush) {
+        if (!bson_ensure_space(b, 1)) return 0;
+        bson_append_byte(b, (char)type);
+        return bson_append_stream_payload(b, name, sl) && bson_ensure_space(b, dataSize);
+    }
     if (!bson_ensure_space(b, 1 + sl + dataSize)) return 0;
     bson_append_byte(b, (char)type);
     bson_append(b, name, sl);
     return 1;
 }
 
+/* Writes the declared size of a document opened by a streaming generator and
+ * remembers where it has to end */
+static int bson_append_stream_size(bson_generator *b) {
+    int size;
+    if (b->sizePos >= b->sizeCount) {
+        b->error = bson_generator_size_mismatch;
+        return 0;
+    }
+    size = b->sizes[b->sizePos++];
+    b->stack[b->stackPos++] = STREAM_POS(b) + size;
+    bson_append32(b, &size);
+    return 1;
+}
+
 int bson_append_int(bson_generator *b, const char *name, const int i) {
     if (!bson_append_estart(b, bson_int, name, 4)) return 0;
     bson_append32(b, &i);
@@ -564,52 +1467,60 @@ int bson_append_max_key(bson_generator *b, const char *name) {
     return 1;
 }
 
-int bson_append_string_base(bson_generator * b, const char * name, const char * value, bson_type type) {
-    int sl = strlen(value) + 1;
-    if (!bson_append_estart(b, type, name, 4 + sl)) return 0;
+int bson_append_string_base(bson_generator * b, const char * name, const char * value, int len, bson_type type) {
+    int sl = len + 1;
+    if (!bson_append_estart(b, type, name, 4 + PAYLOAD_SIZE(b, sl))) return 0;
     bson_append32(b, &sl);
-    bson_append(b, value, sl);
-    return 1;
+    return bson_append_payload(b, value, sl);
 }
 
 int bson_append_string(bson_generator * b, const char * name, const char * value) {
-    return bson_append_string_base(b, name, value, bson_string);
+    return bson_append_string_base(b, name, value, strlen(value), bson_string);
 }
 
 int bson_append_symbol(bson_generator * b, const char * name, const char * value) {
-    return bson_append_string_base(b, name, value, bson_symbol);
+    return bson_append_string_base(b, name, value, strlen(value), bson_symbol);
 }
 
 int bson_append_code(bson_generator * b, const char * name, const char * value) {
-    return bson_append_string_base(b, name, value, bson_code);
+    return bson_append_string_base(b, name, value, strlen(value), bson_code);
+}
+
+int bson_append_string_n(bson_generator * b, const char * name, const char * value, int len) {
+    return bson_append_string_base(b, name, value, len, bson_string);
+}
+
+int bson_append_symbol_n(bson_generator * b, const char * name, const char * value, int len) {
+    return bson_append_string_base(b, name, value, len, bson_symbol);
+}
+
+int bson_append_code_n(bson_generator * b, const char * name, const char * value, int len) {
+    return bson_append_string_base(b, name, value, len, bson_code);
 }
 
 int bson_append_code_w_scope(bson_generator * b, const char * name, const char * code, const bson * scope) {
     int sl = strlen(code) + 1;
     int size = 4 + 4 + sl + bson_size(scope);
-    if (!bson_append_estart(b, bson_codewscope, name, size)) return 0;
+    if (!bson_append_estart(b, bson_codewscope, name, 8 + PAYLOAD_SIZE(b, sl + bson_size(scope)))) return 0;
     bson_append32(b, &size);
     bson_append32(b, &sl);
-    bson_append(b, code, sl);
-    bson_append(b, scope->data, bson_size(scope));
-    return 1;
+    return bson_append_payload(b, code, sl)
+        && bson_append_payload(b, scope->data, bson_size(scope));
 }
 
 int bson_append_binary(bson_generator * b, const char * name, char type, const char * str, int len) {
     int subtwolen = len + 4;
     if (type == 2) {
-        if (!bson_append_estart(b, bson_bindata, name, 4 + 1 + 4 + len)) return 0;
+        if (!bson_append_estart(b, bson_bindata, name, 4 + 1 + 4 + PAYLOAD_SIZE(b, len))) return 0;
         bson_append32(b, &subtwolen);
         bson_append_byte(b, type);
         bson_append32(b, &len);
-        bson_append(b, str, len);
     } else {
-        if (!bson_append_estart(b, bson_bindata, name, 4 + 1 + len)) return 0;
+        if (!bson_append_estart(b, bson_bindata, name, 4 + 1 + PAYLOAD_SIZE(b, len))) return 0;
         bson_append32(b, &len);
         bson_append_byte(b, type);
-        bson_append(b, str, len);
     }
-    return 1;
+    return bson_append_payload(b, str, len);
 }
 
 int bson_append_oid(bson_generator *b, const char *name, const bson_oid_t *oid) {
@@ -627,16 +1538,14 @@ int bson_append_new_oid(bson_generator *b, const char * name) {
 int bson_append_regex(bson_generator *b, const char *name, const char *pattern, const char *opts) {
     const int plen = strlen(pattern)+1;
     const int olen = strlen(opts)+1;
-    if (!bson_append_estart(b, bson_regex, name, plen + olen)) return 0;
-    bson_append(b, pattern, plen);
-    bson_append(b, opts, olen);
-    return 1;
+    if (!bson_append_estart(b, bson_regex, name, PAYLOAD_SIZE(b, plen + olen))) return 0;
+    return bson_append_payload(b, pattern, plen)
+        && bson_append_payload(b, opts, olen);
 }
 
 int bson_append_bson(bson_generator * b, const char * name, const bson* bson) {
-    if (!bson_append_estart(b, bson_object, name, bson_size(bson))) return 0;
-    bson_append(b, bson->data, bson_size(bson));
-    return 1;
+    if (!bson_append_estart(b, bson_object, name, PAYLOAD_SIZE(b, bson_size(bson)))) return 0;
+    return bson_append_payload(b, bson->data, bson_size(bson));
 }
 
 int bson_append_date(bson_generator *b, const char *name, int64_t millis) {
@@ -657,14 +1566,54 @@ int bson_append_timestamp(bson_generator * b, const char * name, const int incr,
 }
 
 int bson_append_start_object(bson_generator *b, const char *name) {
+    if (b->stackPos >= BSON_GENERATOR_DEPTH) {
+        b->error = bson_generator_too_deep;
+        return 0;
+    }
     if (!bson_append_estart(b, bson_object, name, 5)) return 0;
+    if (b->flush) return bson_append_stream_size(b);
     b->stack[b->stackPos++] = b->cur - b->buf;
     bson_append32(b, &zero);
     return 1;
 }
 
 int bson_append_start_array(bson_generator *b, const char * name) {
+    if (b->stackPos >= BSON_GENERATOR_DEPTH) {
+        b->error = bson_generator_too_deep;
+        return 0;
+    }
     if (!bson_append_estart(b, bson_array, name, 5)) return 0;
+    if (b->flush) return bson_append_stream_size(b);
+    b->stack[b->stackPos++] = b->cur - b->buf;
+    bson_append32(b, &zero);
+    return 1;
+}
+
+/* Writes the code string and opens the scope document in place. Both the
+ * code_w_scope total size and the scope size are back-patched on finish. */
+int bson_append_start_code_w_scope(bson_generator *b, const char *name, const char *code) {
+    return bson_append_start_code_w_scope_n(b, name, code, strlen(code));
+}
+
+int bson_append_start_code_w_scope_n(bson_generator *b, const char *name, const char *code, int len) {
+    int sl = len + 1;
+    if (b->stackPos + 2 > BSON_GENERATOR_DEPTH) {
+        b->error = bson_generator_too_deep;
+        return 0;
+    }
+    if (b->flush) {
+        if (!bson_append_estart(b, bson_codewscope, name, 8)) return 0;
+        if (!bson_append_stream_size(b)) return 0;
+        bson_append32(b, &sl);
+        return bson_append_stream_payload(b, code, sl)
+            && bson_ensure_space(b, 5)
+            && bson_append_stream_size(b);
+    }
+    if (!bson_append_estart(b, bson_codewscope, name, 4 + 4 + sl + 5)) return 0;
+    b->stack[b->stackPos++] = b->cur - b->buf;
+    bson_append32(b, &zero);
+    bson_append32(b, &sl);
+    bson_append(b, code, sl);
     b->stack[b->stackPos++] = b->cur - b->buf;
     bson_append32(b, &zero);
     return 1;
@@ -673,9 +1622,38 @@ int bson_append_start_array(bson_generator *b, const char * name) {
 int bson_append_finish_object(bson_generator *b) {
     char * start;
     int i;
+    if (b->stackPos <= 0) return 0;
     if (!bson_ensure_space(b, 1)) return 0;
     bson_append_byte(b, 0);
-    
+
+    if (b->flush) {
+        if (STREAM_POS(b) != b->stack[--b->stackPos]) {
+            b->error = bson_generator_size_mismatch;
+            return 0;
+        }
+        return 1;
+    }
+    start = b->buf + b->stack[--b->stackPos];
+    i = b->cur - start;
+    bson_little_endian32(start, &i);
+
+    return 1;
+}
+
+int bson_append_finish_code_w_scope(bson_generator *b) {
+    char * start;
+    int i;
+    if (b->stackPos < 2) return 0;
+    if (!bson_append_finish_object(b)) return 0;
+
+    if (b->flush) {
+        if (STREAM_POS(b) != b->stack[--b->stackPos]) {
+            b->error = bson_generator_size_mismatch;
+            return 0;
+        }
+        return 1;
+    }
+
     start = b->buf + b->stack[--b->stackPos];
     i = b->cur - start;
     bson_little_endian32(start, &i);
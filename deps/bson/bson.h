@@ -81,19 +81,28 @@ typedef union{
 } bson_oid_t;
 #pragma pack()
 
-/* str must be at least 24 hex chars + null byte */
-void bson_oid_from_string(bson_oid_t* oid, const char* str);
+/* str must hold 24 characters; returns 0 if any is not a hex digit */
+int bson_oid_from_string(bson_oid_t* oid, const char* str);
 
 void bson_oid_to_string(const bson_oid_t* oid, char* str);
 void bson_oid_gen(bson_oid_t* oid);
+/* most ids one batch may take: the counter is 24 bits, so a larger batch
+ * would repeat ids within its second */
+#define BSON_OID_BATCH_MAX (1 << 24)
+/* Fills oids with count new ids created at seconds; count must not exceed
+ * BSON_OID_BATCH_MAX */
+void bson_oid_gen_batch(bson_oid_t* oids, int count, time_t seconds);
 time_t bson_oid_generated_time(bson_oid_t* oid);
 
 /** Parser **/
 
 typedef struct {
-    int (*bson_start_document)(void *ctx, const char *e_name);
+    /* doc is the embedded document, its length not yet checked against the
+     * remain bytes left in the buffer */
+    int (*bson_start_document)(void *ctx, const char *e_name, const char *doc, int remain);
     int (*bson_end_document)(void *ctx);
-    int (*bson_start_array)(void *ctx, const char *e_name);
+    /* count is the number of elements in the array, or -1 if unknown */
+    int (*bson_start_array)(void *ctx, const char *e_name, int count);
     int (*bson_end_array)(void *ctx);
     int (*bson_float)(void *ctx, const char *e_name, double val);
     int (*bson_string)(void *ctx, const char *e_name, const char *string, int length);
@@ -112,33 +121,155 @@ typedef struct {
     int (*bson_integer_64)(void * ctx, const char *e_name, int64_t val);
     int (*bson_min_key)(void *ctx, const char *e_name);
     int (*bson_max_key)(void *ctx, const char *e_name);
+    /* optional; returning 0 skips the element without further callbacks */
+    int (*bson_select)(void *ctx, const char *e_name, bson_type type);
 } bson_parser_callbacks;
 
+/* largest document a server accepts */
+#define BSON_MAX_DOCUMENT_SIZE (16 * 1024 * 1024)
+
+/* nesting levels the parser tracks, the root document included */
+#define BSON_PARSER_DEPTH 32
+
 typedef struct {
     const bson_parser_callbacks *callbacks;
     const char *cur;
     int remain;
     void *ctx;
-    int stack[32];
+    int stack[BSON_PARSER_DEPTH];
     int stackPos;
+    /* set for input that passed bson_validate: skips the length and UTF-8
+     * checks, but never the depth limit */
+    int trusted;
 } bson_parser;
 
 bson_parser bson_init_parser(const char *buf, int buflen, const bson_parser_callbacks *callbacks, void *ctx);
+/* rearms a parser for another document, keeping its callbacks and context */
+void bson_parser_reset(bson_parser *parser, const char *buf, int buflen);
+/* parses the single element (type, name and value) at element */
+bson_parser bson_init_element_parser(const char *element, int len, const bson_parser_callbacks *callbacks, void *ctx);
 int bson_parse(bson_parser *parser);
 
+/* little endian readers for element values */
+int bson_parse_integer_32(const char *cur);
+int64_t bson_parse_integer_64(const char *cur);
+double bson_parse_double(const char *cur);
+
+/* size of the value of an element, or -1 if malformed or truncated */
+int bson_value_size(bson_type type, const char *cur, int remain);
+/* number of elements in a document or array, or -1 if malformed */
+int bson_count_elements(const char *doc, int remain);
+typedef int (*bson_key_callback)(void *ctx, const char *name, int length);
+/* calls cb with each element name in order until it returns 0: the number of
+ * elements, or -1 if cb stopped or the document is malformed */
+int bson_each_key(const char *doc, int remain, bson_key_callback cb, void *ctx);
+/* most names and name bytes, terminators included, a shape may have */
+#define BSON_SHAPE_MAX_KEYS 32
+#define BSON_SHAPE_MAX_BYTES 512
+/* copies the element names of the document at doc, each with its terminator,
+ * into keys and sets hash to their 32-bit FNV-1a hash: the number of bytes
+ * copied, or -1 if the document has no names, names that are not ordinary
+ * properties, more names than fit, or is malformed */
+int bson_shape_keys(const char *doc, int remain, char *keys, int capacity, unsigned int *hash);
+/* locates the element at a dotted path: 1 if found, 0 if not, -1 if malformed */
+int bson_find(const char *doc, int remain, const char *path, const char **element, int *length);
+/* checks the structure of the document at doc: 1 if it is well formed and
+ * nests no deeper than maxDepth (capped at BSON_PARSER_DEPTH), 0 if not */
+int bson_validate(const char *doc, int remain, int maxDepth);
+
+/** Tape **/
+
+/* A flat index of a parsed document, built without touching any JS objects
+ * so it can run off the main thread. Documents and arrays open with their own
+ * entry and are closed by a bson_eoo entry; the root document has only the
+ * closing one, and its shape is in root. Offsets are relative to base. */
+typedef struct {
+    signed char type;
+    char subtype;       /* binary subtype */
+    int key;            /* offset of the element name */
+    int length;         /* payload length, the element count of an array, or
+                           the length of a document's names */
+    union {
+        int offset;     /* string, code, symbol, regex, binary and oid payloads */
+        int int32;      /* int and bool */
+        int64_t int64;  /* long and date; timestamp is timestamp << 32 | increment */
+        double number;
+        struct {
+            int keys;   /* offset of a document's names in the tape's keys as
+                           bson_shape_keys copies them, or -1 if it has no shape */
+            unsigned int hash;
+        } shape;
+    } value;
+} bson_tape_entry;
+
+typedef struct {
+    const char *base;
+    bson_tape_entry *entries;
+    int count;
+    int capacity;
+    bson_tape_entry root;
+    char *keys;
+    int keysLength;
+    int keysCapacity;
+} bson_tape;
+
+/* returns 1 on success, 0 on a parse error or allocation failure */
+int bson_tape_build(bson_tape *tape, const char *buf, int buflen);
+void bson_tape_destroy(bson_tape *tape);
+
 /** Generator **/
 
+/* maximum number of open documents, arrays and code scopes */
+#define BSON_GENERATOR_DEPTH 128
+
+typedef enum {
+    bson_generator_ok = 0,
+    bson_generator_nomem,
+    bson_generator_overflow,
+    bson_generator_too_deep,
+    bson_generator_flush_failed,
+    bson_generator_size_mismatch
+} bson_generator_error;
+
+/* receives each chunk of a streaming generator; returns 0 to stop encoding */
+typedef int (*bson_generator_flush)(void *ctx, const char *data, int len);
+
 typedef struct {
     char * buf;
     char * cur;
     int bufSize;
     int finished;
-    int stack[32];
+    int fixed;
+    int start; /* offset of the current top-level document */
+    bson_generator_error error;
+    int stack[BSON_GENERATOR_DEPTH];
     int stackPos;
+    /* streaming generators only */
+    bson_generator_flush flush;
+    void *flushCtx;
+    const int *sizes;   /* document sizes in the order the documents open */
+    int sizeCount;
+    int sizePos;
+    int flushed;        /* bytes already handed to flush */
 } bson_generator;
 
 bson_generator bson_init_generator();
+/* preallocates size bytes, e.g. the result of an exact size calculation */
+bson_generator bson_init_generator_size(int size);
+/* takes ownership of a malloc'd buffer, e.g. one handed out by a buffer pool */
+bson_generator bson_init_generator_owned(char *buf, int bufSize);
+/* writes into caller-owned memory; appends fail instead of growing the buffer */
+bson_generator bson_init_generator_buffer(char *buf, int bufSize);
+/* writes a single document through buf in chunks handed to flush. Lengths
+ * cannot be back-patched once flushed, so the size of every document, array
+ * and code scope (the code_w_scope total, then its scope) must be known up
+ * front, in the order they open; a mismatch is an error. Payloads larger
+ * than buf are passed to flush directly. */
+bson_generator bson_init_generator_stream(char *buf, int bufSize, const int *sizes, int sizeCount,
+                                          bson_generator_flush flush, void *ctx);
 char *bson_generator_finish(bson_generator *b);
+/* starts another top-level document after the finished one */
+int bson_generator_next(bson_generator *b);
 void bson_generator_destroy(bson_generator *b);
 bson bson_from_buffer(bson_generator *buf);
 
@@ -150,6 +281,10 @@ int bson_append_double(bson_generator *b, const char *name, const double d);
 int bson_append_string(bson_generator *b, const char *name, const char *str);
 int bson_append_symbol(bson_generator *b, const char *name, const char *str);
 int bson_append_code(bson_generator *b, const char *name, const char *str);
+/* the same for strings of len bytes that may hold NULs; str[len] must be NUL */
+int bson_append_string_n(bson_generator *b, const char *name, const char *str, int len);
+int bson_append_symbol_n(bson_generator *b, const char *name, const char *str, int len);
+int bson_append_code_n(bson_generator *b, const char *name, const char *str, int len);
 int bson_append_code_w_scope(bson_generator *b, const char *name, const char *code, const bson *scope);
 int bson_append_binary(bson_generator *b, const char *name, char type, const char *str, int len);
 int bson_append_bool(bson_generator *b, const char *name, const int v);
@@ -165,6 +300,9 @@ int bson_append_timestamp(bson_generator *b, const char *name, const int incr, c
 int bson_append_start_object(bson_generator *b, const char *name);
 int bson_append_start_array(bson_generator *b, const char *name);
 int bson_append_finish_object(bson_generator *b);
+int bson_append_start_code_w_scope(bson_generator *b, const char *name, const char *code);
+int bson_append_start_code_w_scope_n(bson_generator *b, const char *name, const char *code, int len);
+int bson_append_finish_code_w_scope(bson_generator *b);
 
 #ifdef __cplusplus
 }
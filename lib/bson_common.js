@@ -4,6 +4,7 @@ var BSON = exports,
 // BSON MAX VALUES
 BSON.BSON_INT32_MAX = 2147483648;
 BSON.BSON_INT32_MIN = -2147483648;
+BSON.BSON_MAX_DOCUMENT_SIZE = 16 * 1024 * 1024;
 
 // BSON DATA TYPES
 BSON.BSON_DATA_NUMBER = 1;
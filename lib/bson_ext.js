@@ -1,9 +1,30 @@
 var binding = require('../build/default/binding'),
     common = require('./bson_common'),
+    Stream = require('stream').Stream,
+    util = require('util'),
     BSON = module.exports;
 
 BSON.encode      = binding.encode;
+BSON.encodeMany  = binding.encodeMany;
+BSON.encodeInto  = binding.encodeInto;
+BSON.encodeChunked = binding.encodeChunked;
+BSON.calculateObjectSize = binding.calculateObjectSize;
+BSON.configurePool = binding.configurePool;
+BSON.poolStats     = binding.poolStats;
+BSON.configureKeyCache = binding.configureKeyCache;
+BSON.keyCacheStats     = binding.keyCacheStats;
 BSON.decode      = binding.decode;
+BSON.decodeAsync = binding.decodeAsync;
+BSON.decodeMany  = binding.decodeMany;
+BSON.get         = binding.get;
+BSON.getMany     = binding.getMany;
+BSON.validate    = binding.validate;
+BSON.Decoder     = binding.Decoder;
+BSON.BSONFile    = binding.BSONFile;
+BSON.BSONWriter  = binding.BSONWriter;
+BSON.BSONIndex   = binding.BSONIndex;
+BSON.ChunkedEncoder = binding.ChunkedEncoder;
+BSON.buildIndex  = binding.buildIndex;
 BSON.Binary      = common.Binary;
 BSON.DBRef       = common.DBRef;
 BSON.OrderedHash = common.OrderedHash;
@@ -29,4 +50,88 @@ BSON.ObjectID.prototype.__defineGetter__("generationTime", function() {
 BSON.Binary.prototype.asBSON = function() {
   this.buffer.bsonType = this.sub_type;
   return this.buffer;
-};
\ No newline at end of file
+};
+
+// Returns an encoder specialized for documents shaped like template, an
+// example document: the same field names in the same order with the same
+// types. Other documents are encoded as encode() would.
+BSON.compileEncoder = function(template) {
+  return new binding.CompiledEncoder(template);
+};
+
+// Writes one document to a writable stream in chunks of options.chunkSize
+// bytes (64KB by default), encoding the next chunk only once the stream has
+// taken the last: a write() that returns false pauses the encoder until
+// 'drain'. Returns the document size; callback(err) runs once the last chunk
+// is written. The document must not be modified before then.
+BSON.encodeToStream = function(doc, stream, options, callback) {
+  if (typeof options === 'function') {
+    callback = options;
+    options = undefined;
+  }
+  var encoder = new binding.ChunkedEncoder(doc, options);
+
+  function fail(err) {
+    stream.removeListener('drain', pump);
+    if (callback) return callback(err);
+    stream.emit('error', err);
+  }
+
+  function pump() {
+    var chunk;
+    stream.removeListener('drain', pump);
+    try {
+      while ((chunk = encoder.next()) !== null) {
+        if (stream.write(chunk) === false) {
+          stream.on('drain', pump);
+          return;
+        }
+      }
+    } catch (err) {
+      return fail(err);
+    }
+    if (callback) callback(null);
+  }
+
+  pump();
+  return encoder.size;
+};
+
+// A writable stream of back-to-back documents, such as a socket or a .bson
+// file, that emits 'document' for each one as soon as its last byte arrives.
+BSON.DecoderStream = function(options) {
+  Stream.call(this);
+  this.writable = true;
+  this._decoder = new binding.Decoder(options);
+};
+util.inherits(BSON.DecoderStream, Stream);
+
+BSON.DecoderStream.prototype.write = function(chunk) {
+  var documents;
+  try {
+    documents = this._decoder.write(chunk);
+  } catch(err) {
+    this.writable = false;
+    this.emit('error', err);
+    return false;
+  }
+  for (var i = 0; i < documents.length; i++) {
+    this.emit('document', documents[i]);
+  }
+  return true;
+};
+
+BSON.DecoderStream.prototype.end = function(chunk) {
+  if (chunk && !this.write(chunk)) return;
+  this.writable = false;
+  if (this._decoder.pending > 0) {
+    this.emit('error', new Error("Stream ended inside a document"));
+    return;
+  }
+  this.emit('close');
+};
+
+BSON.DecoderStream.prototype.destroy = function() {
+  this.writable = false;
+  this._decoder.reset();
+};
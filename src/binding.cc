@@ -2,6 +2,10 @@
 #include "encode.h"
 #include "decode.h"
 #include "types.h"
+#include "pool.h"
+#include "keys.h"
+#include "file.h"
+#include "index.h"
 
 #include <v8.h>
 #include <node.h>
@@ -14,4 +18,8 @@ init (Handle<Object> target) {
     InitEncoder(target);
     InitDecoder(target);
     InitTypes(target);
+    InitPool(target);
+    InitKeyCache(target);
+    InitFile(target);
+    InitIndex(target);
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "decode.h"
 #include "types.h"
+#include "keys.h"
 
 #include <v8.h>
 #include <node.h>
@@ -7,6 +8,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <bson.h>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 using namespace v8;
 using namespace node;
@@ -15,18 +19,204 @@ using namespace std;
 static Persistent<String> regex_sym;
 static Persistent<String> bson_type_sym;
 static Persistent<String> scope_sym;
+static Persistent<String> fields_sym;
+static Persistent<String> documents_sym;
+static Persistent<String> offset_sym;
+static Persistent<String> trusted_sym;
+static Persistent<String> validated_sym;
+static Persistent<String> max_depth_sym;
+static Persistent<String> max_document_size_sym;
 
+// A tree of requested field paths. Leaves select their whole subtree.
+class Projection {
+  public:
+    Projection() : leaf(false) {}
+
+    ~Projection() {
+        for (size_t i = 0; i < children.size(); i++) {
+            delete children[i].second;
+        }
+    }
+
+    void Add(const char *path) {
+        const char *dot = strchr(path, '.');
+        string name = dot ? string(path, dot - path) : string(path);
+        Projection *child = NULL;
+        for (size_t i = 0; i < children.size(); i++) {
+            if (children[i].first == name) child = children[i].second;
+        }
+        if (!child) {
+            child = new Projection();
+            children.push_back(make_pair(name, child));
+        }
+        if (dot) {
+            child->Add(dot + 1);
+        } else {
+            child->leaf = true;
+        }
+    }
+
+    const Projection *Find(const char *name) const {
+        for (size_t i = 0; i < children.size(); i++) {
+            if (strcmp(children[i].first.c_str(), name) == 0) return children[i].second;
+        }
+        return NULL;
+    }
+
+    bool leaf;
+
+  private:
+    vector<pair<string, Projection *> > children;
+};
+
+// The parser checks its depth before every start callback, so these never
+// hold more than BSON_PARSER_DEPTH levels
 typedef struct {
-    Local<Object> stack[32];
+    Local<Object> stack[BSON_PARSER_DEPTH];
+    // Index after the last element of each open array, -1 for documents
+    int64_t index[BSON_PARSER_DEPTH];
+    // Projection of each open document, NULL when everything is wanted
+    const Projection *proj[BSON_PARSER_DEPTH];
+    const Projection *selected;
     int stackPos;
+    // Projected documents skip keys, so they never match a cached shape
+    bool shapes;
 } bson_context;
 
-int OnDocumentStart(void *ctx, const char *e_name) {
+#define SHAPE_CACHE_SIZE 256
+
+// Documents whose key sequence was seen before are cloned from a boilerplate
+// holding those keys in order, as V8 does for object literals. Clones share
+// the boilerplate's hidden class and their values are stored without any
+// transitions. A sequence only gets a boilerplate the second time it is seen.
+// Entries keep the names themselves, so a hash collision only costs a miss.
+namespace ShapeCache {
+    typedef struct {
+        unsigned int hash;
+        string keys;
+        Persistent<Object> boilerplate;
+    } entry;
+
+    static entry table[SHAPE_CACHE_SIZE];
+
+    // An empty object for a document whose names, as bson_shape_keys
+    // copies them, are keys, with those names in place when they were seen
+    // before
+    Local<Object> Lookup(unsigned int hash, const char *keys, int length) {
+        entry *e = &table[hash & (SHAPE_CACHE_SIZE - 1)];
+        if (e->hash != hash || e->keys.size() != (size_t)length
+                || memcmp(e->keys.data(), keys, length) != 0) {
+            if (!e->boilerplate.IsEmpty()) {
+                e->boilerplate.Dispose();
+                e->boilerplate.Clear();
+            }
+            e->hash = hash;
+            e->keys.assign(keys, length);
+            return Object::New();
+        }
+
+        if (e->boilerplate.IsEmpty()) {
+            Local<Object> boilerplate = Object::New();
+            for (const char *name = keys; name < keys + length; name += strlen(name) + 1) {
+                boilerplate->Set(KeyCache::Get(name), Undefined());
+            }
+            e->boilerplate = Persistent<Object>::New(boilerplate);
+        }
+        return e->boilerplate->Clone();
+    }
+
+    Local<Object> New(const char *doc, int remain) {
+        char keys[BSON_SHAPE_MAX_BYTES];
+        unsigned int hash;
+        int length = bson_shape_keys(doc, remain, keys, sizeof(keys), &hash);
+        return length < 0 ? Object::New() : Lookup(hash, keys, length);
+    }
+
+    // The same for a document of a tape, whose shape was taken off the main
+    // thread
+    Local<Object> FromTape(const bson_tape *tape, const bson_tape_entry *e) {
+        int keys = e->value.shape.keys;
+        return keys < 0 ? Object::New() : Lookup(e->value.shape.hash, tape->keys + keys, e->length);
+    }
+}
+
+// Parses a key that names an array index: decimal digits without a leading
+// zero, below 2^32 - 1
+inline bool ArrayIndex(const char *key, uint32_t *index) {
+    uint64_t i = 0;
+    if (key[0] == '\0' || (key[0] == '0' && key[1] != '\0')) return false;
+    for (const char *p = key; *p; p++) {
+        if (*p < '0' || *p > '9') return false;
+        i = i * 10 + (*p - '0');
+        if (i >= 0xffffffffu) return false;
+    }
+    *index = (uint32_t)i;
+    return true;
+}
+
+// Array elements are stored at the index their key names, so sparse arrays
+// keep their holes; a key that is not an index takes the next position
+inline void SetValue(bson_context *ctx, const char *e_name, Handle<Value> val) {
+    int pos = ctx->stackPos;
+    if (ctx->index[pos] >= 0) {
+        uint32_t i;
+        if (!ArrayIndex(e_name, &i)) {
+            i = ctx->index[pos];
+        }
+        ctx->stack[pos]->Set(i, val);
+        ctx->index[pos] = (int64_t)i + 1;
+    } else {
+        ctx->stack[pos]->Set(KeyCache::Get(e_name), val);
+    }
+}
+
+inline void InitContext(bson_context *ctx, Local<Object> root, int index, const Projection *proj) {
+    ctx->stackPos = 0;
+    ctx->stack[0] = root;
+    ctx->index[0] = index;
+    ctx->proj[0] = proj;
+    ctx->selected = NULL;
+    ctx->shapes = !proj;
+}
+
+// The root object of a document about to be decoded
+inline Local<Object> NewRoot(const char *doc, int length, const Projection *proj) {
+    return proj ? Object::New() : ShapeCache::New(doc, length);
+}
+
+inline void PushValue(bson_context *ctx, Local<Object> obj, int index) {
+    ctx->stackPos += 1;
+    ctx->stack[ctx->stackPos] = obj;
+    ctx->index[ctx->stackPos] = index;
+    ctx->proj[ctx->stackPos] = ctx->selected;
+}
+
+// Paths pass through arrays, so 'a.b' selects b in every document of array a
+int OnSelect(void *ctx, const char *e_name, bson_type type) {
     bson_context *foo = (bson_context *)ctx;
-    Local<Object> obj = Object::New();
-    foo->stack[foo->stackPos]->Set(String::New(e_name), obj);
-    foo->stackPos += 1;
-    foo->stack[foo->stackPos] = obj;
+    const Projection *proj = foo->proj[foo->stackPos];
+    if (!proj) return 1;
+
+    const Projection *child = proj->Find(e_name);
+    if (!child && foo->index[foo->stackPos] >= 0) child = proj;
+    if (!child) return 0;
+
+    if (child->leaf) {
+        foo->selected = NULL;
+        return 1;
+    }
+    foo->selected = child;
+    return type == bson_object || type == bson_array;
+}
+
+inline void PushDocument(bson_context *ctx, const char *e_name, Local<Object> obj) {
+    SetValue(ctx, e_name, obj);
+    PushValue(ctx, obj, -1);
+}
+
+int OnDocumentStart(void *ctx, const char *e_name, const char *doc, int remain) {
+    bson_context *foo = (bson_context *)ctx;
+    PushDocument(foo, e_name, foo->shapes ? ShapeCache::New(doc, remain) : Object::New());
     return 1;
 }
 
@@ -36,12 +226,12 @@ int OnDocumentEnd(void *ctx) {
     return 1;
 }
 
-int OnArrayStart(void *ctx, const char *e_name) {
+int OnArrayStart(void *ctx, const char *e_name, int count) {
     bson_context *foo = (bson_context *)ctx;
-    Local<Array> arr = Array::New();
-    foo->stack[foo->stackPos]->Set(String::New(e_name), arr);
-    foo->stackPos += 1;
-    foo->stack[foo->stackPos] = arr;
+    // A projection may drop elements, so only pre-size complete arrays
+    Local<Array> arr = Array::New(count > 0 && !foo->selected ? count : 0);
+    SetValue(foo, e_name, arr);
+    PushValue(foo, arr, 0);
     return 1;
 }
 
@@ -53,13 +243,13 @@ int OnArrayEnd(void *ctx) {
 
 int OnFloat(void *ctx, const char *e_name, double val) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Number::New(val));
+    SetValue(foo, e_name, Number::New(val));
     return 1;
 }
 
 int OnString(void *ctx, const char *e_name, const char *str, int len) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), String::New(str, len));
+    SetValue(foo, e_name, String::New(str, len));
     return 1;
 }
 
@@ -67,37 +257,37 @@ int OnBinary(void *ctx, const char *e_name, const char *data, unsigned char subt
     bson_context *foo = (bson_context *)ctx;
     node::Buffer *obj = node::Buffer::New((char *)data, (size_t)len);
     obj->handle_->Set(bson_type_sym, Integer::New(subtype));
-    foo->stack[foo->stackPos]->Set(String::New(e_name), obj->handle_);
+    SetValue(foo, e_name, obj->handle_);
     return 1;
 }
 
 int OnUndefined(void *ctx, const char *e_name) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Undefined());
+    SetValue(foo, e_name, Undefined());
     return 1;
 }
 
 int OnObjectID(void *ctx, const char *e_name, bson_oid_t *oid) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), ObjectID::New(oid));
+    SetValue(foo, e_name, ObjectID::New(oid));
     return 1;
 }
 
 int OnBoolean(void *ctx, const char *e_name, int val) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Boolean::New(val));
+    SetValue(foo, e_name, Boolean::New(val));
     return 1;
 }
 
 int OnDatetime(void *ctx, const char *e_name, int64_t date) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Date::New(date));
+    SetValue(foo, e_name, Date::New(date));
     return 1;
 }
 
 int OnNull(void *ctx, const char *e_name) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Null());
+    SetValue(foo, e_name, Null());
     return 1;
 }
 
@@ -110,58 +300,57 @@ int OnRegex(void *ctx, const char *e_name, const char *pattern, const char *opti
         String::New(options)
     };
     Local<Object> obj = fn->NewInstance(2, args);
-    foo->stack[foo->stackPos]->Set(String::New(e_name), obj);
+    SetValue(foo, e_name, obj);
     return 1;
 }
 
 int OnCode(void *ctx, const char *e_name, const char *code, int len) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Code::New(code));
+    SetValue(foo, e_name, Code::New(code));
     return 1;
 }
 
 int OnSymbol(void *ctx, const char *e_name, const char *str, int len) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Symbol::New(str, len));
+    SetValue(foo, e_name, Symbol::New(str, len));
     return 1;
 }
 
 int OnCodeScope(void *ctx, const char *e_name, const char *code, int len) {
     bson_context *foo = (bson_context *)ctx;
     Local<Object> scope = Object::New();
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Code::New(code, scope));
-    foo->stackPos += 1;
-    foo->stack[foo->stackPos] = scope;
+    SetValue(foo, e_name, Code::New(code, scope));
+    PushValue(foo, scope, -1);
     return 1;
 }
 
 int OnInteger32(void *ctx, const char *e_name, int val) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Integer::New(val));
+    SetValue(foo, e_name, Integer::New(val));
     return 1;
 }
 
 int OnTimestamp(void *ctx, const char *e_name, int incr, int ts) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Timestamp::New(incr, ts));
+    SetValue(foo, e_name, Timestamp::New(incr, ts));
     return 1;
 }
 
 int OnInteger64(void *ctx, const char *e_name, int64_t val) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), Number::New((double)val));
+    SetValue(foo, e_name, Number::New((double)val));
     return 1;
 }
 
 int OnMinKey(void *ctx, const char *e_name) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), MinKey::GetFunction());
+    SetValue(foo, e_name, MinKey::GetFunction());
     return 1;
 }
 
 int OnMaxKey(void *ctx, const char *e_name) {
     bson_context *foo = (bson_context *)ctx;
-    foo->stack[foo->stackPos]->Set(String::New(e_name), MaxKey::GetFunction());
+    SetValue(foo, e_name, MaxKey::GetFunction());
     return 1;
 }
 
@@ -189,39 +378,670 @@ static bson_parser_callbacks cbs = {
     OnMaxKey
 };
 
+static bson_parser_callbacks projected_cbs = {
+    OnDocumentStart,
+    OnDocumentEnd,
+    OnArrayStart,
+    OnArrayEnd,
+    OnFloat,
+    OnString,
+    OnBinary,
+    OnUndefined,
+    OnObjectID,
+    OnBoolean,
+    OnDatetime,
+    OnNull,
+    OnRegex,
+    OnCode,
+    OnSymbol,
+    OnCodeScope,
+    OnInteger32,
+    OnTimestamp,
+    OnInteger64,
+    OnMinKey,
+    OnMaxKey,
+    OnSelect
+};
+
+// Builds a projection from {fields: {'a.b': 1, ...}}, or returns NULL if no
+// field is requested
+Projection *NewProjection(Local<Object> options) {
+    Local<Value> fields = options->Get(fields_sym);
+    if (!fields->IsObject()) return NULL;
+
+    Local<Object> obj = fields->ToObject();
+    Local<Array> names = obj->GetPropertyNames();
+    Projection *proj = NULL;
+    for (uint32_t i = 0; i < names->Length(); i++) {
+        Local<Value> name = names->Get(i);
+        if (!obj->Get(name)->BooleanValue()) continue;
+        if (!proj) proj = new Projection();
+        String::Utf8Value path(name);
+        proj->Add(*path);
+    }
+    return proj;
+}
+
+// validate() records every range it accepts on the Buffer itself, as a
+// hidden object mapping offsets to lengths. {trusted: true} only skips the
+// checks for a document inside a recorded range; anything else is parsed
+// with the checks as usual. Returns the recorded ranges, or an empty handle
+// if trusted was not asked for or nothing was validated.
+inline Local<Object> ValidatedRanges(Local<Object> buffer, Local<Object> options) {
+    if (options.IsEmpty() || !options->Get(trusted_sym)->BooleanValue()) {
+        return Local<Object>();
+    }
+    Local<Value> ranges = buffer->GetHiddenValue(validated_sym);
+    return ranges.IsEmpty() || !ranges->IsObject() ? Local<Object>() : ranges->ToObject();
+}
+
+inline int IsValidated(Local<Object> ranges, size_t offset, size_t length) {
+    if (ranges.IsEmpty()) return 0;
+    Local<Value> validated = ranges->Get((uint32_t)offset);
+    return validated->IsNumber() && validated->NumberValue() >= length;
+}
+
+// Documents from files and streams never went through validate(), so
+// trusted does not apply to them
+DocumentDecoder::DocumentDecoder(Handle<Value> options) : proj(NULL) {
+    if (options->IsObject()) {
+        proj = NewProjection(options->ToObject());
+    }
+}
+
+DocumentDecoder::~DocumentDecoder() {
+    delete proj;
+}
+
+Local<Value> DocumentDecoder::Decode(const char *data, int length) {
+    bson_context ctx;
+    InitContext(&ctx, NewRoot(data, length, proj), -1, proj);
+    bson_parser parser = bson_init_parser(data, length, proj ? &projected_cbs : &cbs, &ctx);
+    if (!bson_parse(&parser)) {
+        throw(Exception::Error(String::New("BSON Parse Error")));
+    }
+    return ctx.stack[0];
+}
+
+// decode(buffer, [offset, [length]], [options])
 Handle<Value> decode(const Arguments &args) {
     HandleScope scope;
-    if (!args[0]->IsString()) {
-        return ThrowException(Exception::TypeError(String::New("Value to decode must be a string")));
+    if (!Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(String::New("Value to decode must be a Buffer")));
+    }
+    Local<Object> buffer = args[0]->ToObject();
+    size_t buflen = Buffer::Length(buffer);
+    size_t offset = 0;
+    size_t length;
+    int argc = args.Length();
+    Local<Object> options;
+
+    if (argc > 1 && args[argc - 1]->IsObject()) {
+        options = args[argc - 1]->ToObject();
+        argc--;
+    }
+
+    if (argc > 1 && !args[1]->IsUndefined()) {
+        if (!args[1]->IsNumber() || args[1]->NumberValue() < 0 || args[1]->NumberValue() > buflen) {
+            return ThrowException(Exception::RangeError(String::New("Offset is out of bounds")));
+        }
+        offset = args[1]->Uint32Value();
+    }
+    length = buflen - offset;
+    if (argc > 2 && !args[2]->IsUndefined()) {
+        if (!args[2]->IsNumber() || args[2]->NumberValue() < 0 || args[2]->NumberValue() > length) {
+            return ThrowException(Exception::RangeError(String::New("Length is out of bounds")));
+        }
+        length = args[2]->Uint32Value();
     }
-    Local<String> str = args[0]->ToString();
-    size_t buflen = str->Length();
-    char *buf = (char *)malloc(buflen);
-    node::DecodeWrite(buf, buflen, str, node::BINARY);
 
     bson_context ctx;
-    ctx.stackPos = 0;
-    ctx.stack[0] = Object::New();
-    bson_parser parser = bson_init_parser(buf, buflen, &cbs, &ctx);
+    Projection *proj = options.IsEmpty() ? NULL : NewProjection(options);
+    InitContext(&ctx, NewRoot(Buffer::Data(buffer) + offset, length, proj), -1, proj);
+    bson_parser parser = bson_init_parser(Buffer::Data(buffer) + offset, length,
+        proj ? &projected_cbs : &cbs, &ctx);
+    parser.trusted = IsValidated(ValidatedRanges(buffer, options), offset, length);
 
-    Handle<Value> retval;
-    if (!bson_parse(&parser)) {
-        retval = ThrowException(Exception::Error(String::New("BSON Parse Error")));
+    int ok = bson_parse(&parser);
+    delete proj;
+    if (!ok) {
+        return ThrowException(Exception::Error(String::New("BSON Parse Error")));
+    }
+
+    return scope.Close(ctx.stack[ctx.stackPos]);
+}
+
+// decodeMany(buffer, [offset, [count]], [options]) decodes back-to-back
+// documents. Without a count it stops at the end of the buffer or at the
+// first incomplete document, whose offset is returned.
+Handle<Value> decodeMany(const Arguments &args) {
+    HandleScope scope;
+    if (!Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(String::New("Value to decode must be a Buffer")));
+    }
+    Local<Object> buffer = args[0]->ToObject();
+    size_t buflen = Buffer::Length(buffer);
+    size_t offset = 0;
+    int count = -1;
+    int argc = args.Length();
+    Local<Object> options;
+
+    if (argc > 1 && args[argc - 1]->IsObject()) {
+        options = args[argc - 1]->ToObject();
+        argc--;
+    }
+
+    if (argc > 1 && !args[1]->IsUndefined()) {
+        if (!args[1]->IsNumber() || args[1]->NumberValue() < 0 || args[1]->NumberValue() > buflen) {
+            return ThrowException(Exception::RangeError(String::New("Offset is out of bounds")));
+        }
+        offset = args[1]->Uint32Value();
+    }
+    if (argc > 2 && !args[2]->IsUndefined()) {
+        if (!args[2]->IsNumber() || args[2]->NumberValue() < 0) {
+            return ThrowException(Exception::RangeError(String::New("Count must be a positive number")));
+        }
+        count = args[2]->Int32Value();
+    }
+
+    const char *data = Buffer::Data(buffer);
+    Projection *proj = options.IsEmpty() ? NULL : NewProjection(options);
+    Local<Array> documents = Array::New(count > 0 ? count : 0);
+    bson_context ctx;
+    bson_parser parser = bson_init_parser(data, 0, proj ? &projected_cbs : &cbs, &ctx);
+    Local<Object> ranges = ValidatedRanges(buffer, options);
+    int decoded = 0;
+
+    while (count < 0 || decoded < count) {
+        size_t remain = buflen - offset;
+        int doclen = remain >= 4 ? bson_parse_integer_32(data + offset) : 0;
+        if (remain < 4 || doclen < 5 || (size_t)doclen > remain) {
+            if (count < 0 && (remain < 4 || (size_t)doclen > remain)) break;
+            delete proj;
+            return ThrowException(Exception::Error(String::New("BSON Parse Error")));
+        }
+
+        // Each document is parsed against its own declared length
+        InitContext(&ctx, NewRoot(data + offset, doclen, proj), -1, proj);
+        bson_parser_reset(&parser, data + offset, doclen);
+        parser.trusted = IsValidated(ranges, offset, doclen);
+        if (!bson_parse(&parser)) {
+            delete proj;
+            return ThrowException(Exception::Error(String::New("BSON Parse Error")));
+        }
+        documents->Set(decoded++, ctx.stack[0]);
+        offset += doclen;
+    }
+    delete proj;
+
+    Local<Object> result = Object::New();
+    result->Set(documents_sym, documents);
+    result->Set(offset_sym, Number::New(offset));
+    return scope.Close(result);
+}
+
+// validate(buffer, [offset, [length]], [options]) checks the lengths,
+// terminators, UTF-8 and nesting of a document and returns whether it is well
+// formed. options.maxDepth limits the nesting, the root document included.
+// A document that passes is recorded on the Buffer for trusted decoding.
+Handle<Value> validate(const Arguments &args) {
+    HandleScope scope;
+    if (!Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(String::New("Value to validate must be a Buffer")));
+    }
+    Local<Object> buffer = args[0]->ToObject();
+    size_t buflen = Buffer::Length(buffer);
+    size_t offset = 0;
+    size_t length;
+    int argc = args.Length();
+    int max_depth = BSON_PARSER_DEPTH;
+    Local<Object> options;
+
+    if (argc > 1 && args[argc - 1]->IsObject()) {
+        options = args[argc - 1]->ToObject();
+        argc--;
+    }
+
+    if (argc > 1 && !args[1]->IsUndefined()) {
+        if (!args[1]->IsNumber() || args[1]->NumberValue() < 0 || args[1]->NumberValue() > buflen) {
+            return ThrowException(Exception::RangeError(String::New("Offset is out of bounds")));
+        }
+        offset = args[1]->Uint32Value();
+    }
+    length = buflen - offset;
+    if (argc > 2 && !args[2]->IsUndefined()) {
+        if (!args[2]->IsNumber() || args[2]->NumberValue() < 0 || args[2]->NumberValue() > length) {
+            return ThrowException(Exception::RangeError(String::New("Length is out of bounds")));
+        }
+        length = args[2]->Uint32Value();
+    }
+    if (!options.IsEmpty() && options->Has(max_depth_sym)) {
+        max_depth = options->Get(max_depth_sym)->Int32Value();
+    }
+
+    int ok = bson_validate(Buffer::Data(buffer) + offset, length, max_depth);
+    if (ok) {
+        Local<Value> ranges = buffer->GetHiddenValue(validated_sym);
+        if (ranges.IsEmpty() || !ranges->IsObject()) {
+            ranges = Object::New();
+            buffer->SetHiddenValue(validated_sym, ranges);
+        }
+        ranges->ToObject()->Set((uint32_t)offset, Number::New(length));
+    }
+    return scope.Close(Boolean::New(ok));
+}
+
+// Builds the document from a tape with the regular callbacks. The tape was
+// validated while it was built, so nothing is checked again here.
+void ReplayTape(bson_context *ctx, const bson_tape *tape) {
+    const char *base = tape->base;
+    const bson_tape_entry *e = tape->entries;
+    const bson_tape_entry *end = e + tape->count;
+
+    for (; e < end; e++) {
+        const char *name = base + e->key;
+        switch (e->type) {
+            case bson_eoo:
+                OnDocumentEnd(ctx);
+                break;
+            case bson_object:
+                PushDocument(ctx, name, ShapeCache::FromTape(tape, e));
+                break;
+            case bson_array:
+                OnArrayStart(ctx, name, e->length);
+                break;
+            case bson_double:
+                OnFloat(ctx, name, e->value.number);
+                break;
+            case bson_string:
+                OnString(ctx, name, base + e->value.offset, e->length);
+                break;
+            case bson_bindata:
+                OnBinary(ctx, name, base + e->value.offset, e->subtype, e->length);
+                break;
+            case bson_undefined:
+                OnUndefined(ctx, name);
+                break;
+            case bson_oid:
+                OnObjectID(ctx, name, (bson_oid_t *)(base + e->value.offset));
+                break;
+            case bson_bool:
+                OnBoolean(ctx, name, e->value.int32);
+                break;
+            case bson_date:
+                OnDatetime(ctx, name, e->value.int64);
+                break;
+            case bson_null:
+                OnNull(ctx, name);
+                break;
+            case bson_regex:
+                OnRegex(ctx, name, base + e->value.offset, base + e->value.offset + e->length + 1);
+                break;
+            case bson_code:
+                OnCode(ctx, name, base + e->value.offset, e->length);
+                break;
+            case bson_symbol:
+                OnSymbol(ctx, name, base + e->value.offset, e->length);
+                break;
+            case bson_codewscope:
+                OnCodeScope(ctx, name, base + e->value.offset, e->length);
+                break;
+            case bson_int:
+                OnInteger32(ctx, name, e->value.int32);
+                break;
+            case bson_timestamp:
+                OnTimestamp(ctx, name, (int)(e->value.int64 & 0xffffffff), (int)(e->value.int64 >> 32));
+                break;
+            case bson_long:
+                OnInteger64(ctx, name, e->value.int64);
+                break;
+            case bson_min_key:
+                OnMinKey(ctx, name);
+                break;
+            case bson_max_key:
+                OnMaxKey(ctx, name);
+                break;
+        }
+    }
+}
+
+typedef struct {
+    Persistent<Object> buffer;
+    Persistent<Function> callback;
+    const char *data;
+    size_t length;
+    bson_tape tape;
+    int ok;
+} decode_baton;
+
+// Runs on the thread pool: parse and validate into the tape, no V8 here
+static void DecodeWork(eio_req *req) {
+    decode_baton *baton = (decode_baton *)req->data;
+    baton->ok = bson_tape_build(&baton->tape, baton->data, baton->length);
+}
+
+static int DecodeAfter(eio_req *req) {
+    HandleScope scope;
+    decode_baton *baton = (decode_baton *)req->data;
+    ev_unref(EV_DEFAULT_UC);
+
+    Handle<Value> argv[2];
+    if (baton->ok) {
+        bson_context ctx;
+        InitContext(&ctx, ShapeCache::FromTape(&baton->tape, &baton->tape.root), -1, NULL);
+        ReplayTape(&ctx, &baton->tape);
+        argv[0] = Null();
+        argv[1] = ctx.stack[0];
     } else {
-        retval = ctx.stack[ctx.stackPos];
+        argv[0] = Exception::Error(String::New("BSON Parse Error"));
+        argv[1] = Undefined();
+    }
+
+    TryCatch try_catch;
+    baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    bson_tape_destroy(&baton->tape);
+    baton->buffer.Dispose();
+    baton->callback.Dispose();
+    delete baton;
+    return 0;
+}
+
+// decodeAsync(buffer, [offset, [length]], callback) parses on the thread pool
+// and builds the result on the main thread. The buffer must not be modified
+// until the callback runs.
+Handle<Value> decodeAsync(const Arguments &args) {
+    HandleScope scope;
+    int argc = args.Length();
+    if (!Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(String::New("Value to decode must be a Buffer")));
+    }
+    if (argc < 2 || !args[argc - 1]->IsFunction()) {
+        return ThrowException(Exception::TypeError(String::New("Callback must be a function")));
+    }
+    argc--;
+    Local<Object> buffer = args[0]->ToObject();
+    size_t buflen = Buffer::Length(buffer);
+    size_t offset = 0;
+    size_t length;
+
+    if (argc > 1 && !args[1]->IsUndefined()) {
+        if (!args[1]->IsNumber() || args[1]->NumberValue() < 0 || args[1]->NumberValue() > buflen) {
+            return ThrowException(Exception::RangeError(String::New("Offset is out of bounds")));
+        }
+        offset = args[1]->Uint32Value();
+    }
+    length = buflen - offset;
+    if (argc > 2 && !args[2]->IsUndefined()) {
+        if (!args[2]->IsNumber() || args[2]->NumberValue() < 0 || args[2]->NumberValue() > length) {
+            return ThrowException(Exception::RangeError(String::New("Length is out of bounds")));
+        }
+        length = args[2]->Uint32Value();
+    }
+
+    decode_baton *baton = new decode_baton;
+    baton->buffer = Persistent<Object>::New(buffer);
+    baton->callback = Persistent<Function>::New(Local<Function>::Cast(args[argc]));
+    baton->data = Buffer::Data(buffer) + offset;
+    baton->length = length;
+    baton->ok = 0;
+
+    eio_custom(DecodeWork, EIO_PRI_DEFAULT, DecodeAfter, baton);
+    ev_ref(EV_DEFAULT_UC);
+
+    return Undefined();
+}
+
+// Decodes the element found by bson_find, or returns undefined if the path
+// does not exist
+Handle<Value> decodePath(const char *doc, size_t length, Local<Value> path) {
+    HandleScope scope;
+    String::Utf8Value p(path);
+    const char *element;
+    int elen;
+
+    int found = *p ? bson_find(doc, length, *p, &element, &elen) : 0;
+    if (found < 0) {
+        throw(Exception::Error(String::New("BSON Parse Error")));
+    } else if (!found) {
+        return Undefined();
+    }
+
+    // The element is stored in a holder array, at the index its name gives
+    // if that is an index and at 0 otherwise
+    bson_context ctx;
+    Local<Array> holder = Array::New(1);
+    InitContext(&ctx, holder, 0, NULL);
+    bson_parser parser = bson_init_element_parser(element, elen, &cbs, &ctx);
+
+    if (!bson_parse(&parser)) {
+        throw(Exception::Error(String::New("BSON Parse Error")));
     }
-    free(buf);
+    return scope.Close(holder->Get((uint32_t)(ctx.index[0] - 1)));
+}
 
-    return scope.Close(retval);
+Handle<Value> get(const Arguments &args) {
+    HandleScope scope;
+    if (!Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(String::New("Value to decode must be a Buffer")));
+    }
+    if (!args[1]->IsString()) {
+        return ThrowException(Exception::TypeError(String::New("Path must be a string")));
+    }
+    Local<Object> buffer = args[0]->ToObject();
+
+    try {
+        return scope.Close(decodePath(Buffer::Data(buffer), Buffer::Length(buffer), args[1]));
+    } catch (Local<Value> err) {
+        return ThrowException(err);
+    }
 }
 
+Handle<Value> getMany(const Arguments &args) {
+    HandleScope scope;
+    if (!Buffer::HasInstance(args[0])) {
+        return ThrowException(Exception::TypeError(String::New("Value to decode must be a Buffer")));
+    }
+    if (!args[1]->IsArray()) {
+        return ThrowException(Exception::TypeError(String::New("Paths must be an array")));
+    }
+    Local<Object> buffer = args[0]->ToObject();
+    Local<Array> paths = Local<Array>::Cast(args[1]);
+    Local<Array> values = Array::New(paths->Length());
+
+    try {
+        for (uint32_t i = 0; i < paths->Length(); i++) {
+            values->Set(i, decodePath(Buffer::Data(buffer), Buffer::Length(buffer), paths->Get(i)));
+        }
+    } catch (Local<Value> err) {
+        return ThrowException(err);
+    }
+    return scope.Close(values);
+}
+
+// Decodes back-to-back documents fed in chunks of any size, such as the data
+// events of a socket. Documents that arrive whole are decoded in place from
+// their chunk; only one that straddles a chunk boundary is copied into a
+// staging buffer until its last byte arrives.
+class StreamDecoder : public ObjectWrap {
+  public:
+    static Persistent<FunctionTemplate> constructor_template;
+
+    static void Initialize(Handle<Object> target) {
+        HandleScope scope;
+
+        Local<FunctionTemplate> t = FunctionTemplate::New(New);
+        constructor_template = Persistent<FunctionTemplate>::New(t);
+        constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+        constructor_template->InstanceTemplate()->SetAccessor(String::NewSymbol("pending"), Pending);
+        constructor_template->SetClassName(String::NewSymbol("Decoder"));
+
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "write", Write);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "reset", Reset);
+
+        target->Set(String::NewSymbol("Decoder"), constructor_template->GetFunction());
+    }
+
+  protected:
+    StreamDecoder(Handle<Value> options, int max_size)
+        : ObjectWrap(), decoder(options), max_size(max_size),
+          staged(NULL), staged_len(0), staged_cap(0) {}
+
+    ~StreamDecoder() {
+        free(staged);
+    }
+
+    // new Decoder([options]) takes the decode options plus maxDocumentSize
+    static Handle<Value> New(const Arguments &args) {
+        HandleScope scope;
+        int max_size = BSON_MAX_DOCUMENT_SIZE;
+
+        if (args[0]->IsObject() && args[0]->ToObject()->Has(max_document_size_sym)) {
+            max_size = args[0]->ToObject()->Get(max_document_size_sym)->Int32Value();
+        }
+
+        StreamDecoder *decoder = new StreamDecoder(args[0], max_size);
+        decoder->Wrap(args.This());
+        return args.This();
+    }
+
+    // write(chunk) returns the documents completed by the chunk
+    static Handle<Value> Write(const Arguments &args) {
+        HandleScope scope;
+        StreamDecoder *decoder = ObjectWrap::Unwrap<StreamDecoder>(args.This());
+        if (!Buffer::HasInstance(args[0])) {
+            return ThrowException(Exception::TypeError(String::New("Chunk must be a Buffer")));
+        }
+        Local<Object> chunk = args[0]->ToObject();
+        const char *data = Buffer::Data(chunk);
+        int remain = Buffer::Length(chunk);
+        Local<Array> documents = Array::New();
+        int count = 0;
+
+        try {
+            // Finish the document left over from earlier chunks first
+            if (decoder->staged_len > 0) {
+                int used = decoder->Fill(data, remain);
+                data += used;
+                remain -= used;
+                if (decoder->staged_len < 4 || decoder->staged_len < decoder->StagedSize()) {
+                    return scope.Close(documents);
+                }
+                documents->Set(count++, decoder->decoder.Decode(decoder->staged, decoder->staged_len));
+                decoder->staged_len = 0;
+            }
+
+            while (remain >= 4) {
+                int doclen = decoder->CheckSize(data);
+                if (doclen > remain) break;
+                documents->Set(count++, decoder->decoder.Decode(data, doclen));
+                data += doclen;
+                remain -= doclen;
+            }
+            decoder->Fill(data, remain);
+        } catch (Local<Value> err) {
+            decoder->staged_len = 0;
+            return ThrowException(err);
+        }
+        return scope.Close(documents);
+    }
+
+    // Drops a partially received document
+    static Handle<Value> Reset(const Arguments &args) {
+        HandleScope scope;
+        StreamDecoder *decoder = ObjectWrap::Unwrap<StreamDecoder>(args.This());
+        decoder->staged_len = 0;
+        return Undefined();
+    }
+
+    // Number of bytes of an incomplete document held back for the next chunk
+    static Handle<Value> Pending(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        StreamDecoder *decoder = ObjectWrap::Unwrap<StreamDecoder>(info.This());
+        return scope.Close(Integer::New(decoder->staged_len));
+    }
+
+  private:
+    int CheckSize(const char *data) {
+        int doclen = bson_parse_integer_32(data);
+        if (doclen < 5 || doclen > max_size) {
+            throw(Exception::Error(String::New("BSON Parse Error")));
+        }
+        return doclen;
+    }
+
+    int StagedSize() {
+        return bson_parse_integer_32(staged);
+    }
+
+    void Reserve(int size) {
+        if (size <= staged_cap) return;
+        char *buf = (char *)realloc(staged, size);
+        if (!buf) {
+            throw(Exception::Error(String::New("Out of memory")));
+        }
+        staged = buf;
+        staged_cap = size;
+    }
+
+    // Copies as much of data as the staged document still needs and returns
+    // the number of bytes used
+    int Fill(const char *data, int len) {
+        int used = 0, n;
+        if (len == 0) return 0;
+        if (staged_len < 4) {
+            Reserve(4);
+            n = min(4 - staged_len, len);
+            memcpy(staged + staged_len, data, n);
+            staged_len += n;
+            used += n;
+            if (staged_len < 4) return used;
+            Reserve(CheckSize(staged));
+        }
+        n = min(StagedSize() - staged_len, len - used);
+        memcpy(staged + staged_len, data + used, n);
+        staged_len += n;
+        return used + n;
+    }
+
+    DocumentDecoder decoder;
+    int max_size;
+    char *staged;
+    int staged_len;
+    int staged_cap;
+};
+
+Persistent<FunctionTemplate> StreamDecoder::constructor_template;
+
 void InitDecoder(Handle<Object> target) {
     HandleScope scope;
 
     regex_sym = Persistent<String>::New(String::NewSymbol("RegExp"));
     bson_type_sym = Persistent<String>::New(String::NewSymbol("bsonType"));
     scope_sym = Persistent<String>::New(String::NewSymbol("scope"));
+    fields_sym = Persistent<String>::New(String::NewSymbol("fields"));
+    documents_sym = Persistent<String>::New(String::NewSymbol("documents"));
+    offset_sym = Persistent<String>::New(String::NewSymbol("offset"));
+    trusted_sym = Persistent<String>::New(String::NewSymbol("trusted"));
+    validated_sym = Persistent<String>::New(String::NewSymbol("bson::validated"));
+    max_depth_sym = Persistent<String>::New(String::NewSymbol("maxDepth"));
+    max_document_size_sym = Persistent<String>::New(String::NewSymbol("maxDocumentSize"));
 
     target->Set(String::NewSymbol("decode"),
         FunctionTemplate::New(decode)->GetFunction());
+    target->Set(String::NewSymbol("decodeAsync"),
+        FunctionTemplate::New(decodeAsync)->GetFunction());
+    target->Set(String::NewSymbol("decodeMany"),
+        FunctionTemplate::New(decodeMany)->GetFunction());
+    target->Set(String::NewSymbol("validate"),
+        FunctionTemplate::New(validate)->GetFunction());
+    target->Set(String::NewSymbol("get"),
+        FunctionTemplate::New(get)->GetFunction());
+    target->Set(String::NewSymbol("getMany"),
+        FunctionTemplate::New(getMany)->GetFunction());
+
+    StreamDecoder::Initialize(target);
 }
\ No newline at end of file
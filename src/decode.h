@@ -6,4 +6,18 @@
 
 void InitDecoder(v8::Handle<v8::Object> target);
 
+class Projection;
+
+// Decodes documents one at a time with the options of decode(), parsed once
+class DocumentDecoder {
+  public:
+    DocumentDecoder(v8::Handle<v8::Value> options);
+    ~DocumentDecoder();
+    // Throws a Local<Value> error if the document is malformed
+    v8::Local<v8::Value> Decode(const char *data, int length);
+
+  private:
+    Projection *proj;
+};
+
 #endif	/* _DECODE_H */
\ No newline at end of file
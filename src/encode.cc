@@ -1,20 +1,25 @@
 #include "encode.h"
 #include "types.h"
+#include "pool.h"
 
 #include <v8.h>
 #include <node.h>
 #include <node_buffer.h>
 #include <math.h>
-#include <sstream>
 #include <bson.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
 
 using namespace v8;
 using namespace node;
 using namespace std;
 
 static Persistent<String> as_bson_sym;
-static Persistent<String> id_sym;
 static Persistent<String> regex_sym;
 static Persistent<String> bson_type_sym;
 static Persistent<String> scope_sym;
@@ -26,8 +31,13 @@ static Persistent<String> global_sym;
 static Persistent<String> ignore_case_sym;
 static Persistent<String> multiline_sym;
 static Persistent<String> ordered_keys_sym;
+static Persistent<String> exact_size_sym;
+static Persistent<String> buffer_sym;
+static Persistent<String> offsets_sym;
+static Persistent<String> chunk_size_sym;
 
-bson encodeObject(const Local<Object> object);
+int64_t calculateObjectSize(const Local<Object> object, vector<int> *sizes = NULL,
+                            vector<Persistent<Value> > *resolved = NULL);
 void encodeArray(bson_generator *bb, const char *name, const Local<Value> element);
 inline void encodeToken(bson_generator *bb, const char *name, const Local<Value> element);
 Handle<Value> encode(const Arguments &args);
@@ -37,6 +47,70 @@ const char * ToCString(const String::Utf8Value& value) {
   return *value ? *value : "<string conversion failed>";
 }
 
+Local<Value> generatorError(const bson_generator *bb) {
+    switch (bb->error) {
+        case bson_generator_overflow:
+            return Exception::RangeError(String::New("Buffer is too small for the encoded document"));
+        case bson_generator_too_deep:
+            return Exception::Error(String::New("Document nested too deeply"));
+        case bson_generator_size_mismatch:
+            return Exception::Error(String::New("Encoded size does not match the calculated size"));
+        default:
+            return Exception::Error(String::New("Out of memory"));
+    }
+}
+
+// Element names for array indexes below INDEX_KEYS are formatted once
+#define INDEX_KEYS 1000
+static char index_keys[INDEX_KEYS][4];
+static int index_key_lengths[INDEX_KEYS];
+
+inline const char *indexKey(uint32_t i, char *buf, int *len) {
+    if (i < INDEX_KEYS) {
+        *len = index_key_lengths[i];
+        return index_keys[i];
+    }
+    *len = sprintf(buf, "%u", i);
+    return buf;
+}
+
+inline void checkStart(bson_generator *bb, int ok) {
+    if (!ok) {
+        throw(generatorError(bb));
+    }
+}
+
+// Keys and regex patterns are written as C strings, so an embedded NUL
+// would cut them short; strings carry their length and keep theirs
+inline const char *cstringValue(const String::Utf8Value &v, const char *what) {
+    if (*v && strlen(*v) != (size_t)v.length()) {
+        throw(Exception::TypeError(String::New(what)));
+    }
+    return ToCString(v);
+}
+
+// UTF-8 length of a C string, with the same check as cstringValue
+int64_t cstringSize(const Local<String> s, const char *what) {
+    uint16_t buf[64];
+    for (int i = 0, l = s->Length(); i < l; i += 64) {
+        int n = s->Write(buf, i, 64);
+        for (int j = 0; j < n; j++) {
+            if (buf[j] == 0) {
+                throw(Exception::TypeError(String::New(what)));
+            }
+        }
+    }
+    return s->Utf8Length();
+}
+
+// Byte length of a converted string, NULs included
+inline int utf8Length(const String::Utf8Value &v) {
+    return *v ? v.length() : strlen(ToCString(v));
+}
+
+static const char key_nul[] = "Key must not contain a NUL byte";
+static const char regex_nul[] = "RegExp source must not contain a NUL byte";
+
 // TODO: pass return values
 inline void encodeNull(bson_generator *bb, const char *name) {
     bson_append_null(bb, name);
@@ -46,14 +120,14 @@ inline void encodeString(bson_generator *bb, const char *name, const Local<Value
     HandleScope scope;
     String::Utf8Value v(element);
     const char *value(ToCString(v));
-    bson_append_string(bb, name, value);
+    bson_append_string_n(bb, name, value, utf8Length(v));
 }
 
 inline void encodeSymbol(bson_generator *bb, const char *name, const Local<Object> obj) {
     HandleScope scope;
     String::Utf8Value v(obj->Get(String::NewSymbol("string"))->ToString());
     const char *value(ToCString(v));
-    bson_append_symbol(bb, name, value);
+    bson_append_symbol_n(bb, name, value, utf8Length(v));
 }
 
 inline void encodeNumber(bson_generator *bb, const char *name, const Local<Value> element) {
@@ -92,13 +166,14 @@ inline void encodeCode(bson_generator *bb, const char *name, const Local<Object>
     Local<Value> code = obj->Get(code_sym);
     String::Utf8Value code_utf(code);
     const char *bson_code(ToCString(code_utf));
+    int len = utf8Length(code_utf);
     if (obj->Has(scope_sym)) {
         Local<Value> scope = obj->Get(scope_sym);
-        bson bson_scope(encodeObject(scope->ToObject()));
-        bson_append_code_w_scope(bb, name, bson_code, &bson_scope);
-        bson_destroy(&bson_scope);
+        checkStart(bb, bson_append_start_code_w_scope_n(bb, name, bson_code, len));
+        encodeFields(bb, scope->ToObject());
+        bson_append_finish_code_w_scope(bb);
     } else {
-        bson_append_code(bb, name, bson_code);
+        bson_append_code_n(bb, name, bson_code, len);
     }
 }
 
@@ -116,7 +191,7 @@ inline void encodeFunction(bson_generator *bb, const char *name, const Local<Val
 inline void encodeRegex(bson_generator *bb, const char *name, const Local<Object> obj) {
     Local<Value> source = obj->Get(source_sym);
     String::Utf8Value v(source);
-    const char *value(ToCString(v));
+    const char *value(cstringValue(v, regex_nul));
     char opts[10] = "";
     if (obj->Get(global_sym)->IsTrue()) {
         strcat(opts, "g");
@@ -146,7 +221,9 @@ inline void encodeBinary(bson_generator *bb, const char *name, const Local<Objec
 
 inline void encodeObjectID(bson_generator *bb, const char *name, const Local<Object> obj) {
     bson_oid_t oid;
-    node::DecodeWrite(oid.bytes, 12, obj->Get(id_sym), node::BINARY);
+    if (!ObjectID::Load(obj, &oid)) {
+        throw(Exception::TypeError(String::New("Object is not an ObjectID")));
+    }
     bson_append_oid(bb, name, &oid);
 }
 
@@ -154,39 +231,137 @@ inline void encodeUndefined(bson_generator *bb, const char *name) {
     bson_append_undefined(bb, name);
 }
 
-inline void encodeObjectToken(bson_generator *bb, const char *name, const Local<Value> element) {
-    HandleScope scope;
-    Local<Object> obj = element->ToObject();
+// What kind of object a value is, and so which routine encodes it
+enum ObjectKind {
+    kind_object_id,
+    kind_binary,
+    kind_code,
+    kind_symbol,
+    kind_regex,
+    kind_timestamp,
+    kind_as_bson,
+    kind_plain
+};
+
+#define DISPATCH_CACHE_SIZE 64
+
+// Whether an object is an ObjectID, Buffer, Code, Symbol or Timestamp is
+// checked on the object itself, since any object can inherit from their
+// prototypes. Everything else is decided by the prototype alone, so the
+// constructor name and asBSON lookups run once per prototype rather than
+// once per object. Direct mapped on the prototype's identity hash; a
+// colliding prototype replaces the previous occupant.
+namespace DispatchCache {
+    typedef struct {
+        Persistent<Object> proto;
+        ObjectKind kind;
+    } entry;
+
+    static entry table[DISPATCH_CACHE_SIZE];
+
+    static inline bool Instance(const Local<Value> element, ObjectKind *kind) {
+        if (ObjectID::HasInstance(element)) {
+            *kind = kind_object_id;
+        } else if (Buffer::HasInstance(element)) {
+            *kind = kind_binary;
+        } else if (Code::HasInstance(element)) {
+            *kind = kind_code;
+        } else if (Symbol::HasInstance(element)) {
+            *kind = kind_symbol;
+        } else if (Timestamp::HasInstance(element)) {
+            *kind = kind_timestamp;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // An object made from ObjectID.prototype without the constructor has no
+    // id; it is classed as an ObjectID so that encoding it fails loudly
+    // rather than writing an empty document
+    static ObjectKind Probe(const Local<Object> obj, const Local<Object> proto) {
+        if (ObjectID::IsPrototype(proto)) {
+            return kind_object_id;
+        } else if (obj->Get(constructor_sym)
+                ->ToObject()->Get(name_sym)
+                ->Equals(regex_sym)) {
+            return kind_regex;
+        } else if (proto->Has(as_bson_sym)) {
+            return kind_as_bson;
+        }
+        return kind_plain;
+    }
+
+    // An own asBSON property still takes precedence over a plain prototype
+    static ObjectKind Classify(const Local<Value> element, const Local<Object> obj) {
+        ObjectKind kind;
+        if (Instance(element, &kind)) {
+            return kind;
+        }
 
-    if (ObjectID::HasInstance(element)) {
-        encodeObjectID(bb, name, obj);
-    } else if (Buffer::HasInstance(element)) {
-        encodeBinary(bb, name, obj);
-    } else if (Code::HasInstance(element)) {
-        encodeCode(bb, name, obj);
-    } else if (Symbol::HasInstance(element)) {
-        encodeSymbol(bb, name, obj);
-    } else if (obj->Get(constructor_sym)
-            ->ToObject()->Get(name_sym)
-            ->Equals(regex_sym)) {
-        encodeRegex(bb, name, obj);
-    } else if (Timestamp::HasInstance(element)) {
-        encodeTimestamp(bb, name, obj);
-    } else if (obj->Has(as_bson_sym)) {
+        Local<Value> proto = obj->GetPrototype();
+        if (proto->IsObject()) {
+            Local<Object> p = proto->ToObject();
+            entry *e = &table[p->GetIdentityHash() & (DISPATCH_CACHE_SIZE - 1)];
+            if (e->proto.IsEmpty() || !e->proto->StrictEquals(p)) {
+                if (!e->proto.IsEmpty()) e->proto.Dispose();
+                e->proto = Persistent<Object>::New(p);
+                e->kind = Probe(obj, p);
+            }
+            kind = e->kind;
+        } else {
+            kind = kind_plain;
+        }
+
+        if (kind == kind_plain && obj->HasRealNamedProperty(as_bson_sym)) {
+            kind = kind_as_bson;
+        }
+        return kind;
+    }
+
+    // The value asBSON stands for: its result if it is a method
+    static Local<Value> AsBSON(const Local<Object> obj) {
         Local<Value> prop = obj->Get(as_bson_sym);
-        Local<Value> elem;
         if (prop->IsFunction()) {
             Handle<Function> fn = Handle<Function>::Cast(prop);
             Local<Value> argv[0];
-            elem = fn->Call(obj, 0, argv);
-        } else {
-            elem = prop;
+            return fn->Call(obj, 0, argv);
         }
-        encodeToken(bb, name, elem);
-    } else {
-        bson bson(encodeObject(obj));
-        bson_append_bson(bb, name, &bson);
-        bson_destroy(&bson);
+        return prop;
+    }
+}
+
+inline void encodeObjectToken(bson_generator *bb, const char *name, const Local<Value> element) {
+    HandleScope scope;
+    Local<Object> obj = element->ToObject();
+
+    switch (DispatchCache::Classify(element, obj)) {
+        case kind_object_id:
+            encodeObjectID(bb, name, obj);
+            break;
+        case kind_binary:
+            encodeBinary(bb, name, obj);
+            break;
+        case kind_code:
+            encodeCode(bb, name, obj);
+            break;
+        case kind_symbol:
+            encodeSymbol(bb, name, obj);
+            break;
+        case kind_regex:
+            encodeRegex(bb, name, obj);
+            break;
+        case kind_timestamp:
+            encodeTimestamp(bb, name, obj);
+            break;
+        case kind_as_bson:
+            encodeToken(bb, name, DispatchCache::AsBSON(obj));
+            break;
+        case kind_plain:
+            checkStart(bb, bson_append_start_object(bb, name));
+            encodeFields(bb, obj);
+            bson_append_finish_object(bb);
+            break;
     }
 }
 
@@ -216,16 +391,12 @@ inline void encodeToken(bson_generator *bb, const char *name, const Local<Value>
 
 void encodeArray(bson_generator *bb, const char *name, const Local<Value> element) {
     Local<Array> a = Array::Cast(*element);
-    bson_append_start_array(bb, name);
+    checkStart(bb, bson_append_start_array(bb, name));
 
-    for (int i = 0, l=a->Length(); i < l; i++) {
-        Local<Value> val = a->Get(Number::New(i));
-        stringstream keybuf;
-        string keyval;
-        keybuf << i << endl;
-        keybuf >> keyval;
-
-        encodeToken(bb, keyval.c_str(), val);
+    char keybuf[16];
+    int keylen;
+    for (uint32_t i = 0, l=a->Length(); i < l; i++) {
+        encodeToken(bb, indexKey(i, keybuf, &keylen), a->Get(i));
     }
     bson_append_finish_object(bb);
 }
@@ -243,9 +414,7 @@ inline void checkKey(const char *name) {
     }
 }
 
-bson encodeObject(const Local<Object> object) {
-    bson_generator bb = bson_init_generator();
-    
+void encodeFields(bson_generator *bb, const Local<Object> object) {
     Local<Array> properties;
     Local<Object> values;
 
@@ -256,8 +425,8 @@ bson encodeObject(const Local<Object> object) {
             Local<String> prop_name = properties->Get(i)->ToString();
             Local<Value> prop_val = values->Get(prop_name);
             String::Utf8Value n(prop_name);
-            const char *pname = ToCString(n);
-            encodeToken(&bb, pname, prop_val);
+            const char *pname = cstringValue(n, key_nul);
+            encodeToken(bb, pname, prop_val);
         }
     } else {
         properties = object->GetPropertyNames();
@@ -267,12 +436,176 @@ bson encodeObject(const Local<Object> object) {
             if (!values->IsArray() && !values->HasRealNamedProperty(prop_name)) continue;
             Local<Value> prop_val = values->Get(prop_name);
             String::Utf8Value n(prop_name);
-            const char *pname = ToCString(n);
-            encodeToken(&bb, pname, prop_val);
+            const char *pname = cstringValue(n, key_nul);
+            encodeToken(bb, pname, prop_val);
+        }
+    }
+}
+
+// Size of an element as encodeToken would write it, header included. When
+// sizes is given, the size of every document, array and code scope is
+// appended in the order the encoder opens them; when resolved is given, so
+// is every value an asBSON stands for, for the encoder to reuse.
+int64_t calculateTokenSize(int64_t keylen, const Local<Value> element, vector<int> *sizes = NULL,
+                           vector<Persistent<Value> > *resolved = NULL);
+
+// Reserves the slot of a document opening now, before its children's
+inline size_t reserveSize(vector<int> *sizes) {
+    if (!sizes) return 0;
+    sizes->push_back(0);
+    return sizes->size() - 1;
+}
+
+inline void recordSize(vector<int> *sizes, size_t slot, int64_t size) {
+    if (sizes) (*sizes)[slot] = size > INT_MAX ? INT_MAX : size;
+}
+
+inline int64_t calculateStringSize(const Local<Value> element) {
+    return 4 + element->ToString()->Utf8Length() + 1;
+}
+
+int64_t calculateObjectTokenSize(int64_t keylen, const Local<Value> element, vector<int> *sizes,
+                                 vector<Persistent<Value> > *resolved) {
+    HandleScope scope;
+    Local<Object> obj = element->ToObject();
+    int64_t header = 1 + keylen + 1;
+
+    switch (DispatchCache::Classify(element, obj)) {
+        case kind_object_id:
+            return header + 12;
+        case kind_binary: {
+            int64_t len = Buffer::Length(obj);
+            if (obj->Has(bson_type_sym) && obj->Get(bson_type_sym)->NumberValue() == 2) {
+                len += 4;
+            }
+            return header + 4 + 1 + len;
+        }
+        case kind_code: {
+            int64_t len = calculateStringSize(obj->Get(code_sym));
+            if (obj->Has(scope_sym)) {
+                size_t slot = reserveSize(sizes);
+                int64_t total = 4 + len + calculateObjectSize(obj->Get(scope_sym)->ToObject(), sizes, resolved);
+                recordSize(sizes, slot, total);
+                return header + total;
+            }
+            return header + len;
+        }
+        case kind_symbol:
+            return header + calculateStringSize(obj->Get(String::NewSymbol("string")));
+        case kind_regex: {
+            int64_t opts = obj->Get(global_sym)->IsTrue()
+                + obj->Get(ignore_case_sym)->IsTrue()
+                + obj->Get(multiline_sym)->IsTrue();
+            return header + cstringSize(obj->Get(source_sym)->ToString(), regex_nul) + 1 + opts + 1;
+        }
+        case kind_timestamp:
+            return header + 8;
+        case kind_as_bson: {
+            Local<Value> value = DispatchCache::AsBSON(obj);
+            if (resolved) resolved->push_back(Persistent<Value>::New(value));
+            return calculateTokenSize(keylen, value, sizes, resolved);
+        }
+        case kind_plain:
+            break;
+    }
+    return header + calculateObjectSize(obj, sizes, resolved);
+}
+
+int64_t calculateTokenSize(int64_t keylen, const Local<Value> element, vector<int> *sizes,
+                           vector<Persistent<Value> > *resolved) {
+    int64_t header = 1 + keylen + 1;
+
+    if (element->IsNull() || element->IsUndefined()) {
+        return header;
+    } else if (element->IsString()) {
+        return header + calculateStringSize(element);
+    } else if (element->IsInt32()) {
+        return header + 4;
+    } else if (element->IsNumber() || element->IsDate()) {
+        return header + 8;
+    } else if (element->IsBoolean()) {
+        return header + 1;
+    } else if (element->IsArray()) {
+        HandleScope scope;
+        Local<Array> a = Array::Cast(*element);
+        size_t slot = reserveSize(sizes);
+        int64_t size = 4 + 1;
+        char keybuf[16];
+        int keylen;
+        for (uint32_t i = 0, l=a->Length(); i < l; i++) {
+            indexKey(i, keybuf, &keylen);
+            size += calculateTokenSize(keylen, a->Get(i), sizes, resolved);
         }
+        recordSize(sizes, slot, size);
+        return header + size;
+    } else if (element->IsFunction()) {
+        HandleScope scope;
+        String::Utf8Value nv(Function::Cast(*element)->GetName()->ToString());
+        const char *cls(ToCString(nv));
+        if (strncmp(cls, "MinKey", 6) == 0 || strncmp(cls, "MaxKey", 6) == 0) {
+            return header;
+        }
+        return 0;
+    } else if (element->IsObject()) {
+        return calculateObjectTokenSize(keylen, element, sizes, resolved);
     }
+    return 0;
+}
+
+int64_t calculateObjectSize(const Local<Object> object, vector<int> *sizes,
+                            vector<Persistent<Value> > *resolved) {
+    HandleScope scope;
+    Local<Array> properties;
+    Local<Object> values;
+    size_t slot = reserveSize(sizes);
+    int64_t size = 4 + 1;
+
+    if (object->Has(ordered_keys_sym)) {
+        properties = Array::Cast(*object->Get(ordered_keys_sym));
+        values = object->Get(String::NewSymbol("values"))->ToObject();
+        for (int i = 0; i < properties->Length(); i++) {
+            Local<String> prop_name = properties->Get(i)->ToString();
+            size += calculateTokenSize(cstringSize(prop_name, key_nul), values->Get(prop_name), sizes, resolved);
+        }
+    } else {
+        properties = object->GetPropertyNames();
+        values = object;
+        for (int i = 0; i < properties->Length(); i++) {
+            Local<String> prop_name = properties->Get(i)->ToString();
+            if (!values->IsArray() && !values->HasRealNamedProperty(prop_name)) continue;
+            size += calculateTokenSize(cstringSize(prop_name, key_nul), values->Get(prop_name), sizes, resolved);
+        }
+    }
+
+    recordSize(sizes, slot, size);
+    return size;
+}
+
+// Encodes into a pooled buffer sized by the exact size when known, or else
+// by the previous document
+bson_generator encodeObject(const Local<Object> object, int64_t size) {
+    int capacity;
+    char *buf = GeneratorPool::Acquire((size > 0 && size <= INT_MAX)
+        ? size
+        : GeneratorPool::Estimate(), &capacity);
+    bson_generator bb = bson_init_generator_owned(buf, capacity);
+
+    try {
+        encodeFields(&bb, object);
+        if (!bson_generator_finish(&bb)) {
+            throw(generatorError(&bb));
+        }
+    } catch (Local<Value> err) {
+        GeneratorPool::Release(bb.buf, bb.bufSize);
+        throw;
+    }
+
+    GeneratorPool::Record(bb.cur - bb.buf);
+    return bb;
+}
 
-    return bson_from_buffer(&bb);
+static void FreeGenerated(char *data, void *hint) {
+    GeneratorPool::Release(data, (intptr_t)hint);
 }
 
 Handle<Value> encode(const Arguments &args) {
@@ -281,10 +614,705 @@ Handle<Value> encode(const Arguments &args) {
         return ThrowException(Exception::TypeError(String::New("Value to encode must be an object")));
     }
     try {
-        bson bson(encodeObject(args[0]->ToObject()));
-        Handle<Value> ret = node::Encode(bson.data, bson_size(&bson), node::BINARY);
-        bson_destroy(&bson);
-        return scope.Close(ret);
+        int64_t size = 0;
+        if (args[1]->IsObject() && args[1]->ToObject()->Get(exact_size_sym)->IsTrue()) {
+            size = calculateObjectSize(args[0]->ToObject());
+        }
+        bson_generator bb(encodeObject(args[0]->ToObject(), size));
+        // The buffer takes ownership of the generator memory and hands it
+        // back to the pool once collected
+        Buffer *ret = Buffer::New(bb.buf, bb.cur - bb.buf, FreeGenerated, (void *)(intptr_t)bb.bufSize);
+        return scope.Close(ret->handle_);
+    } catch (Local<Value> err) {
+        return ThrowException(err);
+    }
+}
+
+// encodeMany(docs, [options]) writes every document back-to-back into one
+// generator and returns {buffer, offsets}
+Handle<Value> encodeMany(const Arguments &args) {
+    HandleScope scope;
+    if (!args[0]->IsArray()) {
+        return ThrowException(Exception::TypeError(String::New("Values to encode must be an array")));
+    }
+    Local<Array> docs = Local<Array>::Cast(args[0]);
+    uint32_t count = docs->Length();
+    bool exact = args[1]->IsObject() && args[1]->ToObject()->Get(exact_size_sym)->IsTrue();
+    int64_t size = 0;
+    int capacity;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!docs->Get(i)->IsObject()) {
+            return ThrowException(Exception::TypeError(String::New("Value to encode must be an object")));
+        }
+    }
+
+    try {
+        if (exact) {
+            for (uint32_t i = 0; i < count; i++) {
+                size += calculateObjectSize(docs->Get(i)->ToObject());
+            }
+        } else {
+            size = (int64_t)GeneratorPool::Estimate() * count;
+        }
+    } catch (Local<Value> err) {
+        return ThrowException(err);
+    }
+
+    char *buf = GeneratorPool::Acquire((size > 0 && size <= INT_MAX) ? size : 0, &capacity);
+    bson_generator bb = bson_init_generator_owned(buf, capacity);
+    Local<Array> offsets = Array::New(count);
+
+    try {
+        for (uint32_t i = 0; i < count; i++) {
+            if (i > 0 && !bson_generator_next(&bb)) {
+                throw(generatorError(&bb));
+            }
+            offsets->Set(i, Integer::New(bb.start));
+            encodeFields(&bb, docs->Get(i)->ToObject());
+            if (!bson_generator_finish(&bb)) {
+                throw(generatorError(&bb));
+            }
+        }
+    } catch (Local<Value> err) {
+        GeneratorPool::Release(bb.buf, bb.bufSize);
+        return ThrowException(err);
+    }
+
+    // An empty batch still holds the unfinished first document's header
+    int length = count ? bb.cur - bb.buf : 0;
+    if (count) GeneratorPool::Record(length / count);
+
+    Buffer *ret = Buffer::New(bb.buf, length, FreeGenerated, (void *)(intptr_t)bb.bufSize);
+    Local<Object> result = Object::New();
+    result->Set(buffer_sym, ret->handle_);
+    result->Set(offsets_sym, offsets);
+    return scope.Close(result);
+}
+
+Handle<Value> encodeInto(const Arguments &args) {
+    HandleScope scope;
+    if (!args[0]->IsObject()) {
+        return ThrowException(Exception::TypeError(String::New("Value to encode must be an object")));
+    }
+    if (!Buffer::HasInstance(args[1])) {
+        return ThrowException(Exception::TypeError(String::New("Target must be a Buffer")));
+    }
+    Local<Object> buffer = args[1]->ToObject();
+    size_t buflen = Buffer::Length(buffer);
+    size_t offset = 0;
+
+    if (args.Length() > 2 && !args[2]->IsUndefined()) {
+        if (!args[2]->IsNumber() || args[2]->NumberValue() < 0 || args[2]->NumberValue() > buflen) {
+            return ThrowException(Exception::RangeError(String::New("Offset is out of bounds")));
+        }
+        offset = args[2]->Uint32Value();
+    }
+
+    // Bytes past offset are unspecified if the document does not fit
+    bson_generator bb = bson_init_generator_buffer(Buffer::Data(buffer) + offset, buflen - offset);
+    try {
+        encodeFields(&bb, args[0]->ToObject());
+        if (!bson_generator_finish(&bb)) {
+            throw(generatorError(&bb));
+        }
+    } catch (Local<Value> err) {
+        return ThrowException(err);
+    }
+
+    return scope.Close(Integer::New(bb.cur - bb.buf));
+}
+
+// Hands each chunk of a streaming generator to a JS function as a new Buffer.
+// A throw leaves the exception pending and stops the generator.
+static int WriteChunk(void *ctx, const char *data, int len) {
+    HandleScope scope;
+    Local<Function> write = *(Local<Function> *)ctx;
+    Buffer *chunk = Buffer::New((char *)data, len);
+    Local<Value> argv[1] = { Local<Value>::New(chunk->handle_) };
+    return !write->Call(Context::GetCurrent()->Global(), 1, argv).IsEmpty();
+}
+
+// A document or array the chunked encoder has opened and not yet closed
+struct OpenDocument {
+    Persistent<Object> values;
+    // Property names, empty for arrays
+    Persistent<Array> names;
+    uint32_t index;
+    uint32_t length;
+    // Plain objects skip inherited properties, like encodeFields
+    bool own;
+    // The scope of a code value, closed with its code
+    bool scope;
+};
+
+// Encodes one document through a streaming generator an element at a time,
+// keeping its own stack of open documents so it can stop between any two
+// elements. The size pass keeps what each asBSON returned and the walk
+// takes the values back in the same order, so asBSON runs once per value.
+class DocumentWalk {
+  public:
+    DocumentWalk() : size(0), done(true), buf(NULL), next_resolved(0) {}
+
+    ~DocumentWalk() {
+        Close();
+        free(buf);
+    }
+
+    // Sizes doc and opens it on a buffer of chunk_size bytes that flush
+    // empties each time it fills
+    void Start(const Local<Object> doc, int chunk_size, bson_generator_flush flush, void *ctx) {
+        size = calculateObjectSize(doc, &sizes, &resolved);
+        if (size > INT_MAX) {
+            throw(Exception::RangeError(String::New("Document is too large to encode")));
+        }
+        buf = (char *)malloc(chunk_size);
+        if (!buf) {
+            throw(Exception::Error(String::New("Out of memory")));
+        }
+        bb = bson_init_generator_stream(buf, chunk_size, &sizes[0], sizes.size(), flush, ctx);
+        done = false;
+        Push(doc, false, false);
+    }
+
+    // Appends one element, or closes the innermost open document
+    void Step() {
+        HandleScope scope;
+        OpenDocument &d = open.back();
+
+        if (d.index == d.length) {
+            if (d.scope) {
+                bson_append_finish_code_w_scope(&bb);
+            } else if (open.size() > 1) {
+                bson_append_finish_object(&bb);
+            }
+            Pop();
+            if (open.empty()) {
+                done = true;
+                if (!bson_generator_finish(&bb)) {
+                    throw(generatorError(&bb));
+                }
+            }
+        } else if (d.names.IsEmpty()) {
+            char keybuf[16];
+            int keylen;
+            uint32_t i = d.index++;
+            Encode(indexKey(i, keybuf, &keylen), d.values->Get(i));
+        } else {
+            Local<String> prop_name = d.names->Get(d.index++)->ToString();
+            if (!d.own || d.values->HasRealNamedProperty(prop_name)) {
+                String::Utf8Value n(prop_name);
+                Encode(cstringValue(n, key_nul), d.values->Get(prop_name));
+            }
+        }
+
+        if (bb.error != bson_generator_ok) {
+            throw(generatorError(&bb));
+        }
+    }
+
+    // Whether encoding stopped because flush failed
+    bool FlushFailed() const {
+        return buf && bb.error == bson_generator_flush_failed;
+    }
+
+    // Drops the walk after an error so the document can be collected
+    void Close() {
+        while (!open.empty()) Pop();
+        for (size_t i = 0; i < resolved.size(); i++) resolved[i].Dispose();
+        resolved.clear();
+        done = true;
+    }
+
+    bson_generator bb;
+    int64_t size;
+    bool done;
+
+  private:
+    // Opens obj, whose start has already been appended
+    void Push(Local<Object> obj, bool array, bool scope) {
+        open.push_back(OpenDocument());
+        OpenDocument &d = open.back();
+        d.index = 0;
+        d.scope = scope;
+        d.own = false;
+        if (array) {
+            d.values = Persistent<Object>::New(obj);
+            d.length = Local<Array>::Cast(obj)->Length();
+            return;
+        }
+        if (obj->Has(ordered_keys_sym)) {
+            d.names = Persistent<Array>::New(Local<Array>::Cast(obj->Get(ordered_keys_sym)));
+            d.values = Persistent<Object>::New(obj->Get(String::NewSymbol("values"))->ToObject());
+        } else {
+            d.names = Persistent<Array>::New(obj->GetPropertyNames());
+            d.values = Persistent<Object>::New(obj);
+            d.own = !obj->IsArray();
+        }
+        d.length = d.names->Length();
+    }
+
+    void Pop() {
+        open.back().values.Dispose();
+        if (!open.back().names.IsEmpty()) open.back().names.Dispose();
+        open.pop_back();
+    }
+
+    // Opens documents, arrays and code scopes, and leaves every other value
+    // to encodeToken
+    void Encode(const char *name, Local<Value> value) {
+        for (;;) {
+            if (value->IsArray()) {
+                checkStart(&bb, bson_append_start_array(&bb, name));
+                Push(value->ToObject(), true, false);
+                return;
+            }
+            if (!value->IsObject() || value->IsDate() || value->IsFunction()) break;
+
+            Local<Object> obj = value->ToObject();
+            ObjectKind kind = DispatchCache::Classify(value, obj);
+            if (kind == kind_as_bson) {
+                if (next_resolved == resolved.size()) {
+                    throw(Exception::Error(String::New("Document changed while it was being encoded")));
+                }
+                value = Local<Value>::New(resolved[next_resolved++]);
+                continue;
+            } else if (kind == kind_plain) {
+                checkStart(&bb, bson_append_start_object(&bb, name));
+                Push(obj, false, false);
+                return;
+            } else if (kind == kind_code && obj->Has(scope_sym)) {
+                String::Utf8Value code(obj->Get(code_sym));
+                checkStart(&bb, bson_append_start_code_w_scope_n(&bb, name, ToCString(code), utf8Length(code)));
+                Push(obj->Get(scope_sym)->ToObject(), false, true);
+                return;
+            }
+            break;
+        }
+        encodeToken(&bb, name, value);
+    }
+
+    char *buf;
+    vector<int> sizes;
+    vector<Persistent<Value> > resolved;
+    size_t next_resolved;
+    vector<OpenDocument> open;
+};
+
+// encodeChunked(doc, write, [options]) encodes through a buffer of
+// options.chunkSize bytes, calling write(chunk) each time it fills, and
+// returns the document size. Lengths come from a size pass over the document
+// first, so the encoder's own memory stays bounded by the chunk size; write
+// is called synchronously and must not keep the chunks it is given if the
+// caller needs that bound to hold end to end (see ChunkedEncoder).
+Handle<Value> encodeChunked(const Arguments &args) {
+    HandleScope scope;
+    if (!args[0]->IsObject()) {
+        return ThrowException(Exception::TypeError(String::New("Value to encode must be an object")));
+    }
+    if (!args[1]->IsFunction()) {
+        return ThrowException(Exception::TypeError(String::New("Write callback must be a function")));
+    }
+    Local<Function> write = Local<Function>::Cast(args[1]);
+    int chunk_size = 64 * 1024;
+    if (args[2]->IsObject() && args[2]->ToObject()->Has(chunk_size_sym)) {
+        chunk_size = args[2]->ToObject()->Get(chunk_size_sym)->Int32Value();
+        if (chunk_size < 64) chunk_size = 64;
+    }
+
+    DocumentWalk walk;
+    try {
+        walk.Start(args[0]->ToObject(), chunk_size, WriteChunk, &write);
+        while (!walk.done) {
+            walk.Step();
+        }
+    } catch (Local<Value> err) {
+        // Let an exception from the write callback surface as it is
+        if (walk.FlushFailed()) {
+            return Handle<Value>();
+        }
+        return ThrowException(err);
+    }
+
+    return scope.Close(Number::New(walk.bb.flushed));
+}
+
+// Encodes one document a chunk at a time, on demand: next() runs the
+// encoder only until its buffer fills, so memory stays bounded by the chunk
+// size plus the largest single value however long the consumer takes.
+class ChunkedEncoder : public ObjectWrap {
+  public:
+    static Persistent<FunctionTemplate> constructor_template;
+
+    static void Initialize(Handle<Object> target) {
+        HandleScope scope;
+
+        Local<FunctionTemplate> t = FunctionTemplate::New(New);
+        constructor_template = Persistent<FunctionTemplate>::New(t);
+        constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+        constructor_template->InstanceTemplate()->SetAccessor(String::NewSymbol("size"), Size);
+        constructor_template->SetClassName(String::NewSymbol("ChunkedEncoder"));
+
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "next", Next);
+
+        target->Set(String::NewSymbol("ChunkedEncoder"), constructor_template->GetFunction());
+    }
+
+  protected:
+    ChunkedEncoder() : ObjectWrap() {}
+
+    // new ChunkedEncoder(doc, [options]) sizes the document up front;
+    // options.chunkSize is as for encodeChunked
+    static Handle<Value> New(const Arguments &args) {
+        HandleScope scope;
+        if (!args[0]->IsObject()) {
+            return ThrowException(Exception::TypeError(String::New("Value to encode must be an object")));
+        }
+        int chunk_size = 64 * 1024;
+        if (args[1]->IsObject() && args[1]->ToObject()->Has(chunk_size_sym)) {
+            chunk_size = args[1]->ToObject()->Get(chunk_size_sym)->Int32Value();
+            if (chunk_size < 64) chunk_size = 64;
+        }
+
+        ChunkedEncoder *encoder = new ChunkedEncoder();
+        encoder->Wrap(args.This());
+        try {
+            encoder->walk.Start(args[0]->ToObject(), chunk_size, Collect, encoder);
+        } catch (Local<Value> err) {
+            encoder->walk.Close();
+            return ThrowException(err);
+        }
+        return args.This();
+    }
+
+    // next() returns the next chunk, or null once the document is complete.
+    // The document must not change until then.
+    static Handle<Value> Next(const Arguments &args) {
+        HandleScope scope;
+        ChunkedEncoder *encoder = ObjectWrap::Unwrap<ChunkedEncoder>(args.This());
+
+        try {
+            while (encoder->ready.empty() && !encoder->walk.done) {
+                encoder->walk.Step();
+            }
+        } catch (Local<Value> err) {
+            encoder->walk.Close();
+            encoder->ready.clear();
+            return ThrowException(err);
+        }
+        if (encoder->ready.empty()) {
+            return Null();
+        }
+
+        const string &chunk = encoder->ready.front();
+        Buffer *ret = Buffer::New((char *)chunk.data(), chunk.size());
+        encoder->ready.erase(encoder->ready.begin());
+        return scope.Close(ret->handle_);
+    }
+
+    static Handle<Value> Size(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        return scope.Close(Number::New(ObjectWrap::Unwrap<ChunkedEncoder>(info.This())->walk.size));
+    }
+
+  private:
+    // Flush callback: keeps the chunk until next() hands it out
+    static int Collect(void *ctx, const char *data, int len) {
+        ((ChunkedEncoder *)ctx)->ready.push_back(string(data, len));
+        return 1;
+    }
+
+    DocumentWalk walk;
+    vector<string> ready;
+};
+
+Persistent<FunctionTemplate> ChunkedEncoder::constructor_template;
+
+// The type a compiled encoder expects in a field, taken from the template
+enum FieldType {
+    field_string,
+    field_number,
+    field_boolean,
+    field_date,
+    field_null,
+    field_object_id,
+    field_object,
+    field_any
+};
+
+struct CompiledField {
+    Persistent<String> key;
+    string name;
+    FieldType type;
+    vector<CompiledField> fields;
+};
+
+static FieldType templateType(const Local<Value> value) {
+    if (value->IsNull()) {
+        return field_null;
+    } else if (value->IsString()) {
+        return field_string;
+    } else if (value->IsNumber()) {
+        return field_number;
+    } else if (value->IsBoolean()) {
+        return field_boolean;
+    } else if (value->IsDate()) {
+        return field_date;
+    } else if (value->IsArray() || value->IsFunction() || !value->IsObject()) {
+        return field_any;
+    } else if (ObjectID::HasInstance(value)) {
+        return field_object_id;
+    } else if (DispatchCache::Classify(value, value->ToObject()) == kind_plain) {
+        return field_object;
+    }
+    return field_any;
+}
+
+// Nested templates deeper than the generator allows are left to encodeToken,
+// which also keeps a cyclic template from recursing forever
+static void compileFields(const Local<Object> tmpl, vector<CompiledField> *fields, int depth) {
+    HandleScope scope;
+    Local<Array> properties = tmpl->GetPropertyNames();
+
+    for (uint32_t i = 0; i < properties->Length(); i++) {
+        Local<String> prop_name = properties->Get(i)->ToString();
+        if (!tmpl->HasRealNamedProperty(prop_name)) continue;
+        Local<Value> value = tmpl->Get(prop_name);
+
+        String::Utf8Value n(prop_name);
+
+        fields->push_back(CompiledField());
+        CompiledField &f = fields->back();
+        f.name = cstringValue(n, key_nul);
+        f.key = Persistent<String>::New(String::NewSymbol(f.name.data(), f.name.size()));
+        f.type = templateType(value);
+        if (f.type == field_object && depth < BSON_GENERATOR_DEPTH) {
+            compileFields(value->ToObject(), &f.fields, depth + 1);
+        } else if (f.type == field_object) {
+            f.type = field_any;
+        }
+    }
+}
+
+static void disposeFields(vector<CompiledField> *fields) {
+    for (size_t i = 0; i < fields->size(); i++) {
+        (*fields)[i].key.Dispose();
+        disposeFields(&(*fields)[i].fields);
+    }
+}
+
+// Whether object's own properties are exactly the template's fields, in the
+// same order, as encodeFields would write them
+static bool sameKeys(const vector<CompiledField> &fields, const Local<Object> object) {
+    if (object->Has(ordered_keys_sym)) return false;
+    Local<Array> properties = object->GetPropertyNames();
+    size_t matched = 0;
+
+    for (uint32_t i = 0; i < properties->Length(); i++) {
+        Local<String> prop_name = properties->Get(i)->ToString();
+        if (!object->HasRealNamedProperty(prop_name)) continue;
+        if (matched == fields.size() || !prop_name->StrictEquals(fields[matched].key)) {
+            return false;
+        }
+        matched++;
+    }
+    return matched == fields.size();
+}
+
+// Checks object against the template before anything is encoded: keys
+// first, then each value's type, fetching every value once into values in
+// the order emitCompiled takes them back. A document that does not match
+// falls back to the generic encoder without asBSON or nested getters having
+// run, so nothing is encoded twice.
+static bool matchCompiled(const vector<CompiledField> &fields, const Local<Object> object,
+                          vector<Local<Value> > *values) {
+    if (!sameKeys(fields, object)) return false;
+
+    for (size_t i = 0; i < fields.size(); i++) {
+        const CompiledField &f = fields[i];
+        Local<Value> value = object->Get(f.key);
+        bool ok = true;
+        values->push_back(value);
+
+        switch (f.type) {
+            case field_string:
+                ok = value->IsString();
+                break;
+            case field_number:
+                ok = value->IsNumber();
+                break;
+            case field_boolean:
+                ok = value->IsBoolean();
+                break;
+            case field_date:
+                ok = value->IsDate();
+                break;
+            case field_null:
+                ok = value->IsNull();
+                break;
+            case field_object_id:
+                ok = ObjectID::HasInstance(value);
+                break;
+            case field_object:
+                ok = value->IsObject() && !value->IsArray() && !value->IsDate() && !value->IsFunction()
+                    && DispatchCache::Classify(value, value->ToObject()) == kind_plain
+                    && matchCompiled(f.fields, value->ToObject(), values);
+                break;
+            case field_any:
+                break;
+        }
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Appends the fields matchCompiled checked, in the template's order, from
+// the values it fetched
+static void emitCompiled(bson_generator *bb, const vector<CompiledField> &fields,
+                         const vector<Local<Value> > &values, size_t *next) {
+    for (size_t i = 0; i < fields.size(); i++) {
+        const CompiledField &f = fields[i];
+        const char *name = f.name.c_str();
+        Local<Value> value = values[(*next)++];
+
+        switch (f.type) {
+            case field_string:
+                encodeString(bb, name, value);
+                break;
+            case field_number:
+                if (value->IsInt32()) {
+                    encodeInteger(bb, name, value);
+                } else {
+                    encodeNumber(bb, name, value);
+                }
+                break;
+            case field_boolean:
+                encodeBoolean(bb, name, value);
+                break;
+            case field_date:
+                encodeDate(bb, name, value);
+                break;
+            case field_null:
+                encodeNull(bb, name);
+                break;
+            case field_object_id:
+                encodeObjectID(bb, name, value->ToObject());
+                break;
+            case field_object:
+                checkStart(bb, bson_append_start_object(bb, name));
+                emitCompiled(bb, f.fields, values, next);
+                bson_append_finish_object(bb);
+                break;
+            case field_any:
+                encodeToken(bb, name, value);
+                break;
+        }
+    }
+}
+
+// An encoder specialized for documents shaped like a template: same field
+// names, order and types. Documents that differ are encoded generically.
+class CompiledEncoder : public ObjectWrap {
+  public:
+    static Persistent<FunctionTemplate> constructor_template;
+
+    static void Initialize(Handle<Object> target) {
+        HandleScope scope;
+
+        Local<FunctionTemplate> t = FunctionTemplate::New(New);
+        constructor_template = Persistent<FunctionTemplate>::New(t);
+        constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+        constructor_template->InstanceTemplate()->SetAccessor(String::NewSymbol("fallbacks"), Fallbacks);
+        constructor_template->SetClassName(String::NewSymbol("CompiledEncoder"));
+
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "encode", Encode);
+
+        target->Set(String::NewSymbol("CompiledEncoder"), constructor_template->GetFunction());
+    }
+
+  protected:
+    CompiledEncoder() : ObjectWrap(), fallbacks(0) {}
+
+    ~CompiledEncoder() {
+        disposeFields(&fields);
+    }
+
+    // new CompiledEncoder(template) takes an example document
+    static Handle<Value> New(const Arguments &args) {
+        HandleScope scope;
+        if (!args[0]->IsObject() || args[0]->IsArray()) {
+            return ThrowException(Exception::TypeError(String::New("Template must be an object")));
+        }
+        CompiledEncoder *encoder = new CompiledEncoder();
+        try {
+            compileFields(args[0]->ToObject(), &encoder->fields, 1);
+        } catch (Local<Value> err) {
+            delete encoder;
+            return ThrowException(err);
+        }
+        encoder->Wrap(args.This());
+        return args.This();
+    }
+
+    // encode(doc) returns the same bytes as encode(doc) for matching documents
+    static Handle<Value> Encode(const Arguments &args) {
+        HandleScope scope;
+        CompiledEncoder *encoder = ObjectWrap::Unwrap<CompiledEncoder>(args.This());
+        if (!args[0]->IsObject()) {
+            return ThrowException(Exception::TypeError(String::New("Value to encode must be an object")));
+        }
+        Local<Object> doc = args[0]->ToObject();
+        vector<Local<Value> > values;
+        bson_generator bb;
+
+        if (!matchCompiled(encoder->fields, doc, &values)) {
+            encoder->fallbacks++;
+            try {
+                bb = encodeObject(doc);
+            } catch (Local<Value> err) {
+                return ThrowException(err);
+            }
+        } else {
+            int capacity;
+            char *buf = GeneratorPool::Acquire(GeneratorPool::Estimate(), &capacity);
+            bb = bson_init_generator_owned(buf, capacity);
+            try {
+                size_t next = 0;
+                emitCompiled(&bb, encoder->fields, values, &next);
+                if (!bson_generator_finish(&bb)) {
+                    throw(generatorError(&bb));
+                }
+            } catch (Local<Value> err) {
+                GeneratorPool::Release(bb.buf, bb.bufSize);
+                return ThrowException(err);
+            }
+            GeneratorPool::Record(bb.cur - bb.buf);
+        }
+
+        Buffer *ret = Buffer::New(bb.buf, bb.cur - bb.buf, FreeGenerated, (void *)(intptr_t)bb.bufSize);
+        return scope.Close(ret->handle_);
+    }
+
+    // How many documents did not match the template
+    static Handle<Value> Fallbacks(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        return scope.Close(Number::New(ObjectWrap::Unwrap<CompiledEncoder>(info.This())->fallbacks));
+    }
+
+  private:
+    vector<CompiledField> fields;
+    double fallbacks;
+};
+
+Persistent<FunctionTemplate> CompiledEncoder::constructor_template;
+
+Handle<Value> calculateObjectSize(const Arguments &args) {
+    HandleScope scope;
+    if (!args[0]->IsObject()) {
+        return ThrowException(Exception::TypeError(String::New("Value to measure must be an object")));
+    }
+    try {
+        return scope.Close(Number::New(calculateObjectSize(args[0]->ToObject())));
     } catch (Local<Value> err) {
         return ThrowException(err);
     }
@@ -293,8 +1321,11 @@ Handle<Value> encode(const Arguments &args) {
 void InitEncoder(Handle<Object> target) {
     HandleScope scope;
 
+    for (int i = 0; i < INDEX_KEYS; i++) {
+        index_key_lengths[i] = sprintf(index_keys[i], "%d", i);
+    }
+
     as_bson_sym = Persistent<String>::New(String::NewSymbol("asBSON"));
-    id_sym = Persistent<String>::New(String::NewSymbol("id"));
     regex_sym = Persistent<String>::New(String::NewSymbol("RegExp"));
     bson_type_sym = Persistent<String>::New(String::NewSymbol("bsonType"));
     scope_sym = Persistent<String>::New(String::NewSymbol("scope"));
@@ -306,7 +1337,21 @@ void InitEncoder(Handle<Object> target) {
     ignore_case_sym = Persistent<String>::New(String::NewSymbol("ignoreCase"));
     multiline_sym = Persistent<String>::New(String::NewSymbol("multiline"));
     ordered_keys_sym = Persistent<String>::New(String::NewSymbol("ordered_keys"));
+    exact_size_sym = Persistent<String>::New(String::NewSymbol("exactSize"));
+    buffer_sym = Persistent<String>::New(String::NewSymbol("buffer"));
+    offsets_sym = Persistent<String>::New(String::NewSymbol("offsets"));
+    chunk_size_sym = Persistent<String>::New(String::NewSymbol("chunkSize"));
 
     target->Set(String::NewSymbol("encode"),
         FunctionTemplate::New(encode)->GetFunction());
+    target->Set(String::NewSymbol("encodeMany"),
+        FunctionTemplate::New(encodeMany)->GetFunction());
+    target->Set(String::NewSymbol("encodeInto"),
+        FunctionTemplate::New(encodeInto)->GetFunction());
+    target->Set(String::NewSymbol("encodeChunked"),
+        FunctionTemplate::New(encodeChunked)->GetFunction());
+    target->Set(String::NewSymbol("calculateObjectSize"),
+        FunctionTemplate::New(calculateObjectSize)->GetFunction());
+    ChunkedEncoder::Initialize(target);
+    CompiledEncoder::Initialize(target);
 }
\ No newline at end of file
@@ -2,7 +2,16 @@
 #define	_ENCODE_H
 
 #include <v8.h>
+#include <bson.h>
 
 void InitEncoder(v8::Handle<v8::Object> target);
 
+// Appends the fields of object to the open document, throwing a Local<Value>
+// on errors that stop encoding; others are left in the generator's error
+void encodeFields(bson_generator *bb, const v8::Local<v8::Object> object);
+// Encodes object into a pooled buffer, to be handed back with
+// GeneratorPool::Release(bb.buf, bb.bufSize)
+bson_generator encodeObject(const v8::Local<v8::Object> object, int64_t size = 0);
+v8::Local<v8::Value> generatorError(const bson_generator *bb);
+
 #endif	/* _ENCODE_H */
\ No newline at end of file
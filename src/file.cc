@@ -0,0 +1,495 @@
+#include "file.h"
+#include "decode.h"
+#include "encode.h"
+#include "pool.h"
+
+#include <v8.h>
+#include <node.h>
+#include <node_buffer.h>
+#include <bson.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef __APPLE__
+#define fdatasync fsync
+#endif
+
+using namespace v8;
+using namespace node;
+
+Mapping *MapFile(const char *path, bool sequential) {
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        throw(ErrnoException(errno, "open", "", path));
+    }
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        throw(ErrnoException(err, "fstat", "", path));
+    }
+
+    Mapping *map = new Mapping;
+    map->data = NULL;
+    map->length = st.st_size;
+    map->refs = 1;
+    if (map->length > 0) {
+        void *data = mmap(NULL, map->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            delete map;
+            throw(ErrnoException(err, "mmap", "", path));
+        }
+        map->data = (char *)data;
+        madvise(data, map->length, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+    }
+    // The mapping outlives the descriptor
+    close(fd);
+    return map;
+}
+
+void ReleaseMapping(Mapping *map) {
+    if (--map->refs > 0) return;
+    if (map->data) munmap(map->data, map->length);
+    delete map;
+}
+
+static void FreeSlice(char *data, void *hint) {
+    ReleaseMapping((Mapping *)hint);
+}
+
+// Iterates the back-to-back documents of a .bson dump file, such as those
+// written by mongodump, straight out of a memory mapping.
+class BSONFile : public ObjectWrap {
+  public:
+    static Persistent<FunctionTemplate> constructor_template;
+
+    static void Initialize(Handle<Object> target) {
+        HandleScope scope;
+
+        Local<FunctionTemplate> t = FunctionTemplate::New(New);
+        constructor_template = Persistent<FunctionTemplate>::New(t);
+        constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+        constructor_template->InstanceTemplate()->SetAccessor(String::NewSymbol("offset"), Offset);
+        constructor_template->InstanceTemplate()->SetAccessor(String::NewSymbol("size"), Size);
+        constructor_template->SetClassName(String::NewSymbol("BSONFile"));
+
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "next", Next);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "nextBuffer", NextBuffer);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "seek", Seek);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "close", Close);
+
+        target->Set(String::NewSymbol("BSONFile"), constructor_template->GetFunction());
+    }
+
+  protected:
+    BSONFile(Mapping *map, Handle<Value> options)
+        : ObjectWrap(), map(map), offset(0), decoder(options) {}
+
+    ~BSONFile() {
+        if (map) ReleaseMapping(map);
+    }
+
+    // new BSONFile(path, [options]) takes the options of decode()
+    static Handle<Value> New(const Arguments &args) {
+        HandleScope scope;
+        if (!args[0]->IsString()) {
+            return ThrowException(Exception::TypeError(String::New("Path must be a string")));
+        }
+        String::Utf8Value path(args[0]);
+        Mapping *map;
+        try {
+            map = MapFile(*path);
+        } catch (Local<Value> err) {
+            return ThrowException(err);
+        }
+
+        BSONFile *file = new BSONFile(map, args[1]);
+        file->Wrap(args.This());
+        return args.This();
+    }
+
+    // next() decodes the next document, or returns null at the end of the file
+    static Handle<Value> Next(const Arguments &args) {
+        HandleScope scope;
+        BSONFile *file = ObjectWrap::Unwrap<BSONFile>(args.This());
+        try {
+            int doclen = file->Peek();
+            if (!doclen) return scope.Close(Null());
+            Local<Value> doc = file->decoder.Decode(file->map->data + file->offset, doclen);
+            file->offset += doclen;
+            return scope.Close(doc);
+        } catch (Local<Value> err) {
+            return ThrowException(err);
+        }
+    }
+
+    // nextBuffer() returns the next document as a Buffer over the mapping,
+    // without copying it, or null at the end of the file. Writes to the
+    // Buffer are private to this process.
+    static Handle<Value> NextBuffer(const Arguments &args) {
+        HandleScope scope;
+        BSONFile *file = ObjectWrap::Unwrap<BSONFile>(args.This());
+        try {
+            int doclen = file->Peek();
+            if (!doclen) return scope.Close(Null());
+            file->map->refs++;
+            Buffer *slice = Buffer::New(file->map->data + file->offset, doclen, FreeSlice, file->map);
+            file->offset += doclen;
+            return scope.Close(slice->handle_);
+        } catch (Local<Value> err) {
+            return ThrowException(err);
+        }
+    }
+
+    // seek(offset) moves to a document boundary, e.g. one from an index
+    static Handle<Value> Seek(const Arguments &args) {
+        HandleScope scope;
+        BSONFile *file = ObjectWrap::Unwrap<BSONFile>(args.This());
+        if (!file->map) {
+            return ThrowException(Exception::Error(String::New("File is closed")));
+        }
+        if (!args[0]->IsNumber() || args[0]->NumberValue() < 0 || args[0]->NumberValue() > file->map->length) {
+            return ThrowException(Exception::RangeError(String::New("Offset is out of bounds")));
+        }
+        file->offset = args[0]->IntegerValue();
+        return Undefined();
+    }
+
+    // Slices already handed out stay valid after close
+    static Handle<Value> Close(const Arguments &args) {
+        HandleScope scope;
+        BSONFile *file = ObjectWrap::Unwrap<BSONFile>(args.This());
+        if (file->map) {
+            ReleaseMapping(file->map);
+            file->map = NULL;
+        }
+        return Undefined();
+    }
+
+    static Handle<Value> Offset(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        BSONFile *file = ObjectWrap::Unwrap<BSONFile>(info.This());
+        return scope.Close(Number::New(file->offset));
+    }
+
+    static Handle<Value> Size(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        BSONFile *file = ObjectWrap::Unwrap<BSONFile>(info.This());
+        return scope.Close(Number::New(file->map ? file->map->length : 0));
+    }
+
+  private:
+    // Length of the document at the cursor, or 0 at the end of the file
+    int Peek() {
+        if (!map) {
+            throw(Exception::Error(String::New("File is closed")));
+        }
+        size_t remain = map->length - offset;
+        if (remain == 0) return 0;
+        if (remain < 4) {
+            throw(Exception::Error(String::New("Incomplete document at end of file")));
+        }
+        int doclen = bson_parse_integer_32(map->data + offset);
+        if (doclen < 5) {
+            throw(Exception::Error(String::New("BSON Parse Error")));
+        }
+        if ((size_t)doclen > remain) {
+            throw(Exception::Error(String::New("Incomplete document at end of file")));
+        }
+        return doclen;
+    }
+
+    Mapping *map;
+    size_t offset;
+    DocumentDecoder decoder;
+};
+
+Persistent<FunctionTemplate> BSONFile::constructor_template;
+
+// Writes the whole of iov, resuming after partial writes. Returns 0 or errno.
+static int WriteAll(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Appends documents to a .bson file. They are encoded straight into a large
+// page-aligned buffer that is written out when full; a document larger than
+// the whole buffer goes out with the buffered ones in a single writev.
+class BSONWriter : public ObjectWrap {
+  public:
+    static Persistent<FunctionTemplate> constructor_template;
+
+    static void Initialize(Handle<Object> target) {
+        HandleScope scope;
+
+        Local<FunctionTemplate> t = FunctionTemplate::New(New);
+        constructor_template = Persistent<FunctionTemplate>::New(t);
+        constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+        constructor_template->InstanceTemplate()->SetAccessor(String::NewSymbol("offset"), Offset);
+        constructor_template->SetClassName(String::NewSymbol("BSONWriter"));
+
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "write", Write);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "flush", Flush);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "sync", Sync);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "close", Close);
+
+        target->Set(String::NewSymbol("BSONWriter"), constructor_template->GetFunction());
+    }
+
+  protected:
+    BSONWriter(int fd, char *buf, int capacity, double position, double sync_bytes)
+        : ObjectWrap(), fd(fd), buf(buf), capacity(capacity), used(0), last(0),
+          position(position), sync_bytes(sync_bytes), unsynced(0) {}
+
+    ~BSONWriter() {
+        if (fd >= 0) {
+            WriteBuffered(NULL, 0);
+            close(fd);
+        }
+        free(buf);
+    }
+
+    // new BSONWriter(path, [options]) truncates the file unless options.append
+    // is set. options.bufferSize sets the buffer (1MB by default) and
+    // options.syncBytes syncs to disk every time that many bytes are written.
+    static Handle<Value> New(const Arguments &args) {
+        HandleScope scope;
+        if (!args[0]->IsString()) {
+            return ThrowException(Exception::TypeError(String::New("Path must be a string")));
+        }
+        String::Utf8Value path(args[0]);
+        int capacity = 1024 * 1024;
+        double sync_bytes = 0;
+        bool append = false;
+
+        if (args[1]->IsObject()) {
+            Local<Object> options = args[1]->ToObject();
+            Local<String> buffer_size_sym = String::NewSymbol("bufferSize");
+            Local<String> sync_bytes_sym = String::NewSymbol("syncBytes");
+            if (options->Has(buffer_size_sym)) {
+                capacity = options->Get(buffer_size_sym)->Int32Value();
+            }
+            if (options->Has(sync_bytes_sym)) {
+                sync_bytes = options->Get(sync_bytes_sym)->NumberValue();
+            }
+            append = options->Get(String::NewSymbol("append"))->BooleanValue();
+        }
+        // Whole pages, so the buffer maps cleanly onto the page cache
+        if (capacity < 4096) capacity = 4096;
+        capacity = (capacity + 4095) & ~4095;
+
+        int fd = open(*path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+        if (fd < 0) {
+            return ThrowException(ErrnoException(errno, "open", "", *path));
+        }
+        off_t position = append ? lseek(fd, 0, SEEK_END) : 0;
+
+        void *buf;
+        if (position < 0 || posix_memalign(&buf, 4096, capacity) != 0) {
+            close(fd);
+            return ThrowException(Exception::Error(String::New("Out of memory")));
+        }
+
+        BSONWriter *writer = new BSONWriter(fd, (char *)buf, capacity, position, sync_bytes);
+        writer->Wrap(args.This());
+        return args.This();
+    }
+
+    // write(doc) appends a document and returns its offset in the file
+    static Handle<Value> Write(const Arguments &args) {
+        HandleScope scope;
+        BSONWriter *writer = ObjectWrap::Unwrap<BSONWriter>(args.This());
+        if (writer->fd < 0) {
+            return ThrowException(Exception::Error(String::New("File is closed")));
+        }
+        if (!args[0]->IsObject()) {
+            return ThrowException(Exception::TypeError(String::New("Value to encode must be an object")));
+        }
+        Local<Object> doc = args[0]->ToObject();
+        double offset = writer->position + writer->used;
+
+        try {
+            // A document is expected to be about the size of the last one:
+            // without room for that, the buffer is written out first so the
+            // document is encoded once, into the emptied buffer. One after a
+            // document larger than the buffer gets its own buffer directly.
+            bool fits = false;
+            if (writer->last <= writer->capacity) {
+                if (writer->capacity - writer->used < writer->last) {
+                    writer->WriteOut();
+                }
+                fits = writer->Encode(doc);
+                if (!fits && writer->used > 0) {
+                    writer->WriteOut();
+                    fits = writer->Encode(doc);
+                }
+            }
+            if (!fits) {
+                bson_generator bb(encodeObject(doc));
+                struct iovec extra;
+                extra.iov_base = bb.buf;
+                extra.iov_len = bb.cur - bb.buf;
+                writer->last = extra.iov_len;
+                int err = writer->WriteBuffered(&extra, 1);
+                GeneratorPool::Release(bb.buf, bb.bufSize);
+                if (err) {
+                    throw(ErrnoException(err, "writev"));
+                }
+            }
+        } catch (Local<Value> err) {
+            return ThrowException(err);
+        }
+        return scope.Close(Number::New(offset));
+    }
+
+    static Handle<Value> Flush(const Arguments &args) {
+        HandleScope scope;
+        BSONWriter *writer = ObjectWrap::Unwrap<BSONWriter>(args.This());
+        if (writer->fd < 0) {
+            return ThrowException(Exception::Error(String::New("File is closed")));
+        }
+        int err = writer->WriteBuffered(NULL, 0);
+        if (err) {
+            return ThrowException(ErrnoException(err, "writev"));
+        }
+        return Undefined();
+    }
+
+    // sync() flushes the buffer and waits for the data to reach the disk
+    static Handle<Value> Sync(const Arguments &args) {
+        HandleScope scope;
+        BSONWriter *writer = ObjectWrap::Unwrap<BSONWriter>(args.This());
+        if (writer->fd < 0) {
+            return ThrowException(Exception::Error(String::New("File is closed")));
+        }
+        int err = writer->WriteBuffered(NULL, 0);
+        if (err) {
+            return ThrowException(ErrnoException(err, "writev"));
+        }
+        if (fdatasync(writer->fd) < 0) {
+            return ThrowException(ErrnoException(errno, "fdatasync"));
+        }
+        writer->unsynced = 0;
+        return Undefined();
+    }
+
+    // close() flushes, and syncs as well if syncBytes is set
+    static Handle<Value> Close(const Arguments &args) {
+        HandleScope scope;
+        BSONWriter *writer = ObjectWrap::Unwrap<BSONWriter>(args.This());
+        if (writer->fd < 0) return Undefined();
+
+        int err = writer->WriteBuffered(NULL, 0);
+        if (!err && writer->sync_bytes > 0 && writer->unsynced > 0 && fdatasync(writer->fd) < 0) {
+            err = errno;
+        }
+        close(writer->fd);
+        writer->fd = -1;
+        if (err) {
+            return ThrowException(ErrnoException(err, "close"));
+        }
+        return Undefined();
+    }
+
+    // Bytes written so far, including those still buffered
+    static Handle<Value> Offset(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        BSONWriter *writer = ObjectWrap::Unwrap<BSONWriter>(info.This());
+        return scope.Close(Number::New(writer->position + writer->used));
+    }
+
+  private:
+    // Encodes doc into the free end of the buffer. Returns false if it does
+    // not fit, leaving the buffer as it was.
+    bool Encode(Local<Object> doc) {
+        bson_generator bb = bson_init_generator_buffer(buf + used, capacity - used);
+        encodeFields(&bb, doc);
+        if (bson_generator_finish(&bb)) {
+            last = bb.cur - bb.buf;
+            used += last;
+            return true;
+        }
+        if (bb.error != bson_generator_overflow) {
+            throw(generatorError(&bb));
+        }
+        return false;
+    }
+
+    void WriteOut() {
+        int err = WriteBuffered(NULL, 0);
+        if (err) {
+            throw(ErrnoException(err, "writev"));
+        }
+    }
+
+    // Writes out the buffer followed by extra, then syncs if syncBytes have
+    // accumulated. Returns 0 or errno.
+    int WriteBuffered(struct iovec *extra, int count) {
+        struct iovec iov[2];
+        int n = 0;
+        size_t total = used;
+        if (used > 0) {
+            iov[n].iov_base = buf;
+            iov[n].iov_len = used;
+            n++;
+        }
+        for (int i = 0; i < count; i++) {
+            total += extra[i].iov_len;
+            iov[n++] = extra[i];
+        }
+        if (n == 0) return 0;
+
+        int err = WriteAll(fd, iov, n);
+        if (err) return err;
+        used = 0;
+        position += total;
+        unsynced += total;
+        if (sync_bytes > 0 && unsynced >= sync_bytes) {
+            if (fdatasync(fd) < 0) return errno;
+            unsynced = 0;
+        }
+        return 0;
+    }
+
+    int fd;
+    char *buf;
+    int capacity;
+    int used;
+    // Size of the last document written
+    int last;
+    double position;
+    double sync_bytes;
+    double unsynced;
+};
+
+Persistent<FunctionTemplate> BSONWriter::constructor_template;
+
+void InitFile(Handle<Object> target) {
+    HandleScope scope;
+    BSONFile::Initialize(target);
+    BSONWriter::Initialize(target);
+}
@@ -0,0 +1,23 @@
+#ifndef _FILE_H
+#define	_FILE_H
+
+#include <v8.h>
+#include <stddef.h>
+
+void InitFile(v8::Handle<v8::Object> target);
+
+// A private, copy-on-write mapping of a whole file, shared by its reader and
+// the Buffer slices handed out over it. It is unmapped when the last
+// reference is released.
+struct Mapping {
+    char *data;
+    size_t length;
+    int refs;
+};
+
+// Maps path with a sequential or random access hint, throwing an errno
+// exception as a Local<Value> on failure
+Mapping *MapFile(const char *path, bool sequential = true);
+void ReleaseMapping(Mapping *map);
+
+#endif	/* _FILE_H */
@@ -0,0 +1,547 @@
+#include "index.h"
+#include "file.h"
+#include "decode.h"
+#include "encode.h"
+#include "pool.h"
+
+#include <v8.h>
+#include <node.h>
+#include <bson.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace v8;
+using namespace node;
+using namespace std;
+
+// Sidecar layout, little endian throughout:
+//   "BSONIDX1", data file size, document count, key count (8 bytes each),
+//   field path length (4 bytes), 4 reserved bytes, the path padded to 8,
+//   then per document its offset (8) and length (4),
+//   then per key, sorted, its heap offset (8), length (4) and document (4),
+//   then the key heap.
+#define INDEX_MAGIC "BSONIDX1"
+#define INDEX_HEADER 40
+#define INDEX_DOC 12
+#define INDEX_ENTRY 16
+
+// Keys are stored in a form that sorts with memcmp: a type class byte ordered
+// as MongoDB orders types, then a big-endian value
+#define KEY_NUMBER 0x10
+#define KEY_STRING 0x20
+#define KEY_OID 0x70
+#define KEY_BOOL 0x80
+#define KEY_DATE 0x90
+
+static Persistent<String> field_sym;
+static Persistent<String> index_sym;
+static Persistent<String> documents_sym;
+static Persistent<String> keys_sym;
+
+static inline void AppendBigEndian(string *key, uint64_t bits) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        key->push_back((char)(bits >> shift));
+    }
+}
+
+// Appends the sortable key of the value of element. Returns false for types
+// that are not indexed.
+static bool AppendKey(const char *element, string *key) {
+    bson_type type = (bson_type)element[0];
+    const char *value = element + 1 + strlen(element + 1) + 1;
+    double number;
+    uint64_t bits;
+
+    switch (type) {
+        case bson_int:
+            number = bson_parse_integer_32(value);
+            break;
+        case bson_long:
+            number = (double)bson_parse_integer_64(value);
+            break;
+        case bson_double:
+            number = bson_parse_double(value);
+            if (number == 0) number = 0; // -0 and 0 are the same key
+            break;
+        case bson_string:
+        case bson_symbol:
+            key->push_back(KEY_STRING);
+            key->append(value + 4, bson_parse_integer_32(value) - 1);
+            return true;
+        case bson_oid:
+            key->push_back(KEY_OID);
+            key->append(value, 12);
+            return true;
+        case bson_bool:
+            key->push_back(KEY_BOOL);
+            key->push_back(value[0] ? 1 : 0);
+            return true;
+        case bson_date:
+            key->push_back(KEY_DATE);
+            AppendBigEndian(key, (uint64_t)bson_parse_integer_64(value) ^ (1ULL << 63));
+            return true;
+        default:
+            return false;
+    }
+
+    // Flipping the sign bit, or every bit of negatives, orders doubles as
+    // unsigned integers
+    memcpy(&bits, &number, 8);
+    bits = (bits >> 63) ? ~bits : bits | (1ULL << 63);
+    key->push_back(KEY_NUMBER);
+    AppendBigEndian(key, bits);
+    return true;
+}
+
+// The sortable key of a JS value, encoded the way encode() would store it.
+// Throws a TypeError for types that are not indexed.
+static string ValueKey(Handle<Value> value) {
+    HandleScope scope;
+    Local<Object> holder = Object::New();
+    holder->Set(String::New(""), value);
+
+    bson_generator bb = encodeObject(holder);
+    string key;
+    bool ok = bb.cur - bb.buf > 5 && AppendKey(bb.buf + 4, &key);
+    GeneratorPool::Release(bb.buf, bb.bufSize);
+    if (!ok) {
+        throw(Exception::TypeError(String::New("Value cannot be used as an index key")));
+    }
+    return key;
+}
+
+static inline int CompareKeys(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, min(alen, blen));
+    if (c) return c;
+    return alen < blen ? -1 : alen > blen;
+}
+
+struct KeyEntry {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t doc;
+};
+
+struct KeyLess {
+    const char *heap;
+    KeyLess(const char *heap) : heap(heap) {}
+    bool operator()(const KeyEntry &a, const KeyEntry &b) const {
+        int c = CompareKeys(heap + a.offset, a.length, heap + b.offset, b.length);
+        return c ? c < 0 : a.doc < b.doc;
+    }
+};
+
+static void WriteIndex(const char *path, uint64_t data_size, const string &field,
+                       const vector<uint64_t> &offsets, const vector<uint32_t> &lengths,
+                       const vector<KeyEntry> &entries, const string &heap) {
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        throw(ErrnoException(errno, "fopen", "", path));
+    }
+    char header[INDEX_HEADER], record[INDEX_ENTRY];
+    uint64_t count = offsets.size(), keys = entries.size();
+    uint32_t field_len = field.size(), zero = 0;
+    size_t padded = (field_len + 7) & ~7;
+
+    memcpy(header, INDEX_MAGIC, 8);
+    bson_little_endian64(header + 8, &data_size);
+    bson_little_endian64(header + 16, &count);
+    bson_little_endian64(header + 24, &keys);
+    bson_little_endian32(header + 32, &field_len);
+    bson_little_endian32(header + 36, &zero);
+    fwrite(header, INDEX_HEADER, 1, out);
+    fwrite(field.data(), field_len, 1, out);
+    fwrite("\0\0\0\0\0\0\0", padded - field_len, 1, out);
+
+    for (size_t i = 0; i < offsets.size(); i++) {
+        bson_little_endian64(record, &offsets[i]);
+        bson_little_endian32(record + 8, &lengths[i]);
+        fwrite(record, INDEX_DOC, 1, out);
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        bson_little_endian64(record, &entries[i].offset);
+        bson_little_endian32(record + 8, &entries[i].length);
+        bson_little_endian32(record + 12, &entries[i].doc);
+        fwrite(record, INDEX_ENTRY, 1, out);
+    }
+    fwrite(heap.data(), heap.size(), 1, out);
+
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed) {
+        throw(ErrnoException(errno, "fwrite", "", path));
+    }
+}
+
+// buildIndex(dataPath, [options]) scans a .bson file once, recording where
+// every document starts and, if options.field names a (dotted) path, the
+// sorted values of that field. Only the indexed element of each document is
+// read; everything else is skipped by its length. The index is written to
+// options.index, or dataPath + '.idx'. Returns {documents, keys}.
+Handle<Value> BuildIndex(const Arguments &args) {
+    HandleScope scope;
+    if (!args[0]->IsString()) {
+        return ThrowException(Exception::TypeError(String::New("Path must be a string")));
+    }
+    String::Utf8Value data_path(args[0]);
+    string index_path = string(*data_path) + ".idx";
+    string field;
+
+    if (args[1]->IsObject()) {
+        Local<Object> options = args[1]->ToObject();
+        if (options->Get(field_sym)->IsString()) {
+            field = *String::Utf8Value(options->Get(field_sym));
+        }
+        if (options->Get(index_sym)->IsString()) {
+            index_path = *String::Utf8Value(options->Get(index_sym));
+        }
+    }
+
+    Mapping *map = NULL;
+    vector<uint64_t> offsets;
+    vector<uint32_t> lengths;
+    vector<KeyEntry> entries;
+    string heap;
+
+    try {
+        map = MapFile(*data_path);
+        size_t offset = 0;
+        while (offset < map->length) {
+            const char *doc = map->data + offset;
+            size_t remain = map->length - offset;
+            int doclen = remain >= 4 ? bson_parse_integer_32(doc) : 0;
+            if (remain < 4 || doclen < 5 || (size_t)doclen > remain) {
+                throw(Exception::Error(String::New("Incomplete document at end of file")));
+            }
+
+            if (!field.empty()) {
+                const char *element;
+                int elen;
+                int found = bson_find(doc, doclen, field.c_str(), &element, &elen);
+                if (found < 0) {
+                    throw(Exception::Error(String::New("BSON Parse Error")));
+                }
+                KeyEntry entry;
+                entry.offset = heap.size();
+                if (found && AppendKey(element, &heap)) {
+                    entry.length = heap.size() - entry.offset;
+                    entry.doc = offsets.size();
+                    entries.push_back(entry);
+                }
+            }
+            offsets.push_back(offset);
+            lengths.push_back(doclen);
+            offset += doclen;
+        }
+
+        sort(entries.begin(), entries.end(), KeyLess(heap.data()));
+        WriteIndex(index_path.c_str(), map->length, field, offsets, lengths, entries, heap);
+    } catch (Local<Value> err) {
+        if (map) ReleaseMapping(map);
+        return ThrowException(err);
+    }
+    ReleaseMapping(map);
+
+    Local<Object> result = Object::New();
+    result->Set(documents_sym, Number::New(offsets.size()));
+    result->Set(keys_sym, Number::New(entries.size()));
+    return scope.Close(result);
+}
+
+// Answers lookups against a .bson file through its index without scanning
+// the data: documents by position, and keys by binary search.
+class BSONIndex : public ObjectWrap {
+  public:
+    static Persistent<FunctionTemplate> constructor_template;
+
+    static void Initialize(Handle<Object> target) {
+        HandleScope scope;
+
+        Local<FunctionTemplate> t = FunctionTemplate::New(New);
+        constructor_template = Persistent<FunctionTemplate>::New(t);
+        constructor_template->InstanceTemplate()->SetInternalFieldCount(1);
+        constructor_template->InstanceTemplate()->SetAccessor(String::NewSymbol("count"), Count);
+        constructor_template->InstanceTemplate()->SetAccessor(String::NewSymbol("keys"), Keys);
+        constructor_template->InstanceTemplate()->SetAccessor(String::NewSymbol("field"), Field);
+        constructor_template->SetClassName(String::NewSymbol("BSONIndex"));
+
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "document", Document);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "offset", Offset);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "find", Find);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "range", Range);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "close", Close);
+
+        target->Set(String::NewSymbol("BSONIndex"), constructor_template->GetFunction());
+    }
+
+  protected:
+    BSONIndex(Mapping *index, Mapping *data, Handle<Value> options)
+        : ObjectWrap(), index(index), data(data), decoder(options) {
+        const char *header = index->data;
+        uint32_t field_len;
+        bson_little_endian64(&count, header + 16);
+        bson_little_endian64(&keys, header + 24);
+        bson_little_endian32(&field_len, header + 32);
+        field.assign(header + INDEX_HEADER, field_len);
+        docs = header + INDEX_HEADER + ((field_len + 7) & ~7);
+        entries = docs + count * INDEX_DOC;
+        heap = entries + keys * INDEX_ENTRY;
+        heap_size = index->length - (heap - header);
+    }
+
+    ~BSONIndex() {
+        Release();
+    }
+
+    // new BSONIndex(dataPath, [options]) opens the index written by
+    // buildIndex, from options.index or dataPath + '.idx'. The other options
+    // are those of decode().
+    static Handle<Value> New(const Arguments &args) {
+        HandleScope scope;
+        if (!args[0]->IsString()) {
+            return ThrowException(Exception::TypeError(String::New("Path must be a string")));
+        }
+        String::Utf8Value data_path(args[0]);
+        string index_path = string(*data_path) + ".idx";
+        if (args[1]->IsObject() && args[1]->ToObject()->Get(index_sym)->IsString()) {
+            index_path = *String::Utf8Value(args[1]->ToObject()->Get(index_sym));
+        }
+
+        Mapping *index = NULL, *data = NULL;
+        try {
+            index = MapFile(index_path.c_str(), false);
+            data = MapFile(*data_path, false);
+            CheckIndex(index, data);
+        } catch (Local<Value> err) {
+            if (index) ReleaseMapping(index);
+            if (data) ReleaseMapping(data);
+            return ThrowException(err);
+        }
+
+        BSONIndex *idx = new BSONIndex(index, data, args[1]);
+        idx->Wrap(args.This());
+        return args.This();
+    }
+
+    // document(i) decodes the i-th document of the file
+    static Handle<Value> Document(const Arguments &args) {
+        HandleScope scope;
+        BSONIndex *idx = ObjectWrap::Unwrap<BSONIndex>(args.This());
+        try {
+            return scope.Close(idx->DecodeDocument(idx->Position(args[0])));
+        } catch (Local<Value> err) {
+            return ThrowException(err);
+        }
+    }
+
+    // offset(i) is where the i-th document starts, e.g. for BSONFile#seek
+    static Handle<Value> Offset(const Arguments &args) {
+        HandleScope scope;
+        BSONIndex *idx = ObjectWrap::Unwrap<BSONIndex>(args.This());
+        try {
+            uint64_t offset;
+            uint32_t length;
+            idx->ReadDocument(idx->Position(args[0]), &offset, &length);
+            return scope.Close(Number::New(offset));
+        } catch (Local<Value> err) {
+            return ThrowException(err);
+        }
+    }
+
+    // find(value) decodes every document whose field equals value
+    static Handle<Value> Find(const Arguments &args) {
+        HandleScope scope;
+        BSONIndex *idx = ObjectWrap::Unwrap<BSONIndex>(args.This());
+        try {
+            idx->CheckOpen();
+            string key = ValueKey(args[0]);
+            uint64_t first = idx->LowerBound(key, false);
+            uint64_t last = idx->LowerBound(key, true);
+            return scope.Close(idx->DecodeEntries(first, last, -1));
+        } catch (Local<Value> err) {
+            return ThrowException(err);
+        }
+    }
+
+    // range(low, high, [limit]) decodes, in key order, the documents whose
+    // field is at least low and below high. Either bound may be null.
+    static Handle<Value> Range(const Arguments &args) {
+        HandleScope scope;
+        BSONIndex *idx = ObjectWrap::Unwrap<BSONIndex>(args.This());
+        try {
+            idx->CheckOpen();
+            uint64_t first = 0, last = idx->keys;
+            if (!args[0]->IsNull() && !args[0]->IsUndefined()) {
+                first = idx->LowerBound(ValueKey(args[0]), false);
+            }
+            if (!args[1]->IsNull() && !args[1]->IsUndefined()) {
+                last = idx->LowerBound(ValueKey(args[1]), false);
+            }
+            int64_t limit = args[2]->IsNumber() ? args[2]->IntegerValue() : -1;
+            return scope.Close(idx->DecodeEntries(first, max(first, last), limit));
+        } catch (Local<Value> err) {
+            return ThrowException(err);
+        }
+    }
+
+    static Handle<Value> Close(const Arguments &args) {
+        HandleScope scope;
+        ObjectWrap::Unwrap<BSONIndex>(args.This())->Release();
+        return Undefined();
+    }
+
+    static Handle<Value> Count(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        return scope.Close(Number::New(ObjectWrap::Unwrap<BSONIndex>(info.This())->count));
+    }
+
+    static Handle<Value> Keys(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        return scope.Close(Number::New(ObjectWrap::Unwrap<BSONIndex>(info.This())->keys));
+    }
+
+    static Handle<Value> Field(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        BSONIndex *idx = ObjectWrap::Unwrap<BSONIndex>(info.This());
+        return scope.Close(String::New(idx->field.data(), idx->field.size()));
+    }
+
+  private:
+    // Rejects a truncated index, or one built before the data file changed
+    static void CheckIndex(Mapping *index, Mapping *data) {
+        uint64_t data_size, count, keys;
+        uint32_t field_len;
+        const char *header = index->data;
+
+        if (index->length < INDEX_HEADER || memcmp(header, INDEX_MAGIC, 8) != 0) {
+            throw(Exception::Error(String::New("Not a BSON index file")));
+        }
+        bson_little_endian64(&data_size, header + 8);
+        bson_little_endian64(&count, header + 16);
+        bson_little_endian64(&keys, header + 24);
+        bson_little_endian32(&field_len, header + 32);
+        // Checked a table at a time so that no count can overflow the sum
+        uint64_t remain = index->length - INDEX_HEADER;
+        uint64_t field_size = ((uint64_t)field_len + 7) & ~(uint64_t)7;
+        if (field_size > remain || count > (remain -= field_size) / INDEX_DOC
+                || keys > (remain -= count * INDEX_DOC) / INDEX_ENTRY) {
+            throw(Exception::Error(String::New("Index file is truncated")));
+        }
+        if (data_size != data->length) {
+            throw(Exception::Error(String::New("Index does not match the data file")));
+        }
+    }
+
+    void CheckOpen() {
+        if (!index) {
+            throw(Exception::Error(String::New("Index is closed")));
+        }
+    }
+
+    uint64_t Position(Handle<Value> arg) {
+        CheckOpen();
+        if (!arg->IsNumber() || arg->NumberValue() < 0 || arg->NumberValue() >= count) {
+            throw(Exception::RangeError(String::New("Document number is out of bounds")));
+        }
+        return arg->IntegerValue();
+    }
+
+    // First entry whose key is not below key, or above it when upper is set
+    uint64_t LowerBound(const string &key, bool upper) {
+        uint64_t lo = 0, hi = keys;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            uint32_t length;
+            const char *entry_key = ReadKey(mid, &length);
+            int c = CompareKeys(entry_key, length, key.data(), key.size());
+            if (c < 0 || (upper && c == 0)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Offsets and lengths read from the index are checked against the
+    // mappings as they are used, so a damaged file throws instead of reading
+    // out of bounds
+    static Local<Value> Corrupt() {
+        return Exception::Error(String::New("Index file is corrupt"));
+    }
+
+    void ReadDocument(uint64_t i, uint64_t *offset, uint32_t *length) {
+        bson_little_endian64(offset, docs + i * INDEX_DOC);
+        bson_little_endian32(length, docs + i * INDEX_DOC + 8);
+        if (*offset > data->length || *length > data->length - *offset) {
+            throw(Corrupt());
+        }
+    }
+
+    const char *ReadKey(uint64_t i, uint32_t *length) {
+        uint64_t offset;
+        bson_little_endian64(&offset, entries + i * INDEX_ENTRY);
+        bson_little_endian32(length, entries + i * INDEX_ENTRY + 8);
+        if (offset > heap_size || *length > heap_size - offset) {
+            throw(Corrupt());
+        }
+        return heap + offset;
+    }
+
+    Local<Value> DecodeDocument(uint64_t i) {
+        uint64_t offset;
+        uint32_t length;
+        ReadDocument(i, &offset, &length);
+        return decoder.Decode(data->data + offset, length);
+    }
+
+    Local<Array> DecodeEntries(uint64_t first, uint64_t last, int64_t limit) {
+        if (limit >= 0 && last - first > (uint64_t)limit) last = first + limit;
+        Local<Array> result = Array::New(last - first);
+        for (uint64_t i = first; i < last; i++) {
+            uint32_t doc;
+            bson_little_endian32(&doc, entries + i * INDEX_ENTRY + 12);
+            if (doc >= count) {
+                throw(Corrupt());
+            }
+            result->Set(i - first, DecodeDocument(doc));
+        }
+        return result;
+    }
+
+    void Release() {
+        if (index) ReleaseMapping(index);
+        if (data) ReleaseMapping(data);
+        index = data = NULL;
+    }
+
+    Mapping *index;
+    Mapping *data;
+    DocumentDecoder decoder;
+    string field;
+    uint64_t count;
+    uint64_t keys;
+    const char *docs;
+    const char *entries;
+    const char *heap;
+    uint64_t heap_size;
+};
+
+Persistent<FunctionTemplate> BSONIndex::constructor_template;
+
+void InitIndex(Handle<Object> target) {
+    HandleScope scope;
+
+    field_sym = Persistent<String>::New(String::NewSymbol("field"));
+    index_sym = Persistent<String>::New(String::NewSymbol("index"));
+    documents_sym = Persistent<String>::New(String::NewSymbol("documents"));
+    keys_sym = Persistent<String>::New(String::NewSymbol("keys"));
+
+    target->Set(String::NewSymbol("buildIndex"),
+        FunctionTemplate::New(BuildIndex)->GetFunction());
+    BSONIndex::Initialize(target);
+}
@@ -0,0 +1,8 @@
+#ifndef _INDEX_H
+#define	_INDEX_H
+
+#include <v8.h>
+
+void InitIndex(v8::Handle<v8::Object> target);
+
+#endif	/* _INDEX_H */
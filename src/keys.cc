@@ -0,0 +1,125 @@
+#include "keys.h"
+
+#include <v8.h>
+#include <node.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+using namespace v8;
+using namespace node;
+
+// Longer names are rare and not worth pinning in memory
+#define KEY_CACHE_MAX_KEY 64
+
+namespace KeyCache {
+    typedef struct {
+        uint32_t hash;
+        int length;
+        char *key;
+        Persistent<String> sym;
+    } entry;
+
+    // Direct mapped: a colliding name replaces the previous occupant
+    static entry *table = NULL;
+    static uint32_t capacity = 0;
+    static uint32_t used = 0;
+    static double hits = 0;
+    static double misses = 0;
+
+    static void Clear() {
+        for (uint32_t i = 0; i < capacity; i++) {
+            if (table[i].key) {
+                free(table[i].key);
+                table[i].sym.Dispose();
+                table[i].sym.Clear();
+            }
+        }
+        free(table);
+        table = NULL;
+        capacity = 0;
+        used = 0;
+    }
+
+    static void Resize(uint32_t size) {
+        Clear();
+        // Round up to a power of two so the hash can be masked
+        while (capacity < size) capacity = capacity ? capacity << 1 : 1;
+        if (capacity) table = (entry *)calloc(capacity, sizeof(entry));
+        if (!table) capacity = 0;
+    }
+
+    Handle<String> Get(const char *key) {
+        // FNV-1a, measuring the name in the same pass
+        uint32_t hash = 2166136261u;
+        int length = 0;
+        while (key[length] && length <= KEY_CACHE_MAX_KEY) {
+            hash = (hash ^ (unsigned char)key[length]) * 16777619u;
+            length++;
+        }
+        if (!capacity || length > KEY_CACHE_MAX_KEY) {
+            misses++;
+            return String::New(key);
+        }
+
+        entry *e = &table[hash & (capacity - 1)];
+        if (e->key && e->hash == hash && e->length == length
+                && memcmp(e->key, key, length) == 0) {
+            hits++;
+            return e->sym;
+        }
+
+        misses++;
+        if (e->key) {
+            free(e->key);
+            e->sym.Dispose();
+        } else {
+            used++;
+        }
+        e->hash = hash;
+        e->length = length;
+        e->key = (char *)malloc(length);
+        if (!e->key) {
+            e->sym.Clear();
+            used--;
+            return String::New(key, length);
+        }
+        memcpy(e->key, key, length);
+        e->sym = Persistent<String>::New(String::NewSymbol(key, length));
+        return e->sym;
+    }
+
+    Handle<Value> Configure(const Arguments &args) {
+        HandleScope scope;
+        if (!args[0]->IsObject()) {
+            return ThrowException(Exception::TypeError(String::New("Key cache options must be an object")));
+        }
+        Local<String> size_sym = String::NewSymbol("size");
+        Local<Object> opts = args[0]->ToObject();
+        if (opts->Has(size_sym)) {
+            Resize(opts->Get(size_sym)->Uint32Value());
+        }
+        return Undefined();
+    }
+
+    Handle<Value> Stats(const Arguments &args) {
+        HandleScope scope;
+        Local<Object> stats = Object::New();
+        stats->Set(String::NewSymbol("size"), Integer::NewFromUnsigned(used));
+        stats->Set(String::NewSymbol("capacity"), Integer::NewFromUnsigned(capacity));
+        stats->Set(String::NewSymbol("hits"), Number::New(hits));
+        stats->Set(String::NewSymbol("misses"), Number::New(misses));
+        return scope.Close(stats);
+    }
+}
+
+void InitKeyCache(Handle<Object> target) {
+    HandleScope scope;
+
+    KeyCache::Resize(1024);
+
+    target->Set(String::NewSymbol("configureKeyCache"),
+        FunctionTemplate::New(KeyCache::Configure)->GetFunction());
+    target->Set(String::NewSymbol("keyCacheStats"),
+        FunctionTemplate::New(KeyCache::Stats)->GetFunction());
+}
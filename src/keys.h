@@ -0,0 +1,14 @@
+#ifndef _KEYS_H
+#define	_KEYS_H
+
+#include <v8.h>
+
+void InitKeyCache(v8::Handle<v8::Object> target);
+
+namespace KeyCache {
+    // Returns an internalized string for a NUL terminated element name,
+    // shared across elements and decode calls.
+    v8::Handle<v8::String> Get(const char *key);
+}
+
+#endif	/* _KEYS_H */
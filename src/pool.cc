@@ -0,0 +1,209 @@
+#include "pool.h"
+
+#include <v8.h>
+#include <node.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+using namespace v8;
+using namespace node;
+using namespace std;
+
+// Size classes are powers of two from the generator's initial 128 bytes up
+// to 16MB, the largest document MongoDB accepts.
+#define POOL_MIN_SHIFT 7
+#define POOL_MAX_SHIFT 24
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+// A buffer grown by realloc is larger than its class, and keeps its real
+// capacity so it is counted and handed out as what it is
+struct PooledBuffer {
+    char *buf;
+    int capacity;
+};
+
+namespace GeneratorPool {
+    static vector<PooledBuffer> free_lists[POOL_CLASSES];
+    static size_t max_bytes = 8 * 1024 * 1024;
+    static size_t max_buffers = 64;
+    static double idle_timeout = 5.0;
+    static size_t pooled_bytes = 0;
+    static double hits = 0;
+    static double misses = 0;
+    // Decaying average of recent document sizes
+    static double average_size = 0;
+    static bool active = false;
+    static bool timer_running = false;
+    static ev_timer idle_timer;
+
+    static inline int ClassSize(int c) {
+        return 1 << (c + POOL_MIN_SHIFT);
+    }
+
+    // Smallest class holding size bytes, or POOL_CLASSES if none does
+    static inline int ClassFor(int size) {
+        int c = 0;
+        while (c < POOL_CLASSES && ClassSize(c) < size) c++;
+        return c;
+    }
+
+    static void Drop(int c) {
+        free(free_lists[c].back().buf);
+        pooled_bytes -= free_lists[c].back().capacity;
+        free_lists[c].pop_back();
+    }
+
+    // Frees pooled buffers, largest first, until at most keep bytes remain
+    static void Trim(size_t keep) {
+        for (int c = POOL_CLASSES - 1; c >= 0 && pooled_bytes > keep; c--) {
+            while (!free_lists[c].empty() && pooled_bytes > keep) {
+                Drop(c);
+            }
+        }
+    }
+
+    static void StopTimer() {
+        if (!timer_running) return;
+        ev_ref(EV_DEFAULT_UC);
+        ev_timer_stop(EV_DEFAULT_UC, &idle_timer);
+        timer_running = false;
+    }
+
+    // The timer is unref'd so an idle pool never keeps the process alive
+    static void StartTimer() {
+        if (timer_running || idle_timeout <= 0) return;
+        ev_timer_set(&idle_timer, idle_timeout, idle_timeout);
+        ev_timer_start(EV_DEFAULT_UC, &idle_timer);
+        ev_unref(EV_DEFAULT_UC);
+        timer_running = true;
+    }
+
+    static void OnIdle(EV_P_ ev_timer *watcher, int revents) {
+        if (active) {
+            active = false;
+            return;
+        }
+        Trim(0);
+        StopTimer();
+    }
+
+    char *Acquire(int size, int *capacity) {
+        int c = ClassFor(size);
+        active = true;
+
+        if (c == POOL_CLASSES) {
+            misses++;
+            *capacity = size;
+            return (char *)malloc(size);
+        }
+
+        if (!free_lists[c].empty()) {
+            PooledBuffer b = free_lists[c].back();
+            free_lists[c].pop_back();
+            pooled_bytes -= b.capacity;
+            *capacity = b.capacity;
+            hits++;
+            return b.buf;
+        }
+        misses++;
+        *capacity = ClassSize(c);
+        return (char *)malloc(*capacity);
+    }
+
+    void Release(char *buf, int capacity) {
+        if (!buf) return;
+        if (capacity < ClassSize(0)) {
+            free(buf);
+            return;
+        }
+
+        // Buffers grown by realloc land in the largest class they can serve
+        int c = ClassFor(capacity);
+        if (c == POOL_CLASSES || ClassSize(c) > capacity) c--;
+
+        if (free_lists[c].size() >= max_buffers || pooled_bytes + capacity > max_bytes) {
+            free(buf);
+            return;
+        }
+        PooledBuffer b = { buf, capacity };
+        free_lists[c].push_back(b);
+        pooled_bytes += capacity;
+        StartTimer();
+    }
+
+    // One outlying document moves the estimate by an eighth of the
+    // difference rather than setting it
+    void Record(int size) {
+        if (average_size == 0) {
+            average_size = size;
+        } else {
+            average_size += (size - average_size) / 8;
+        }
+    }
+
+    // Never past the largest class, so an estimate alone cannot ask for an
+    // allocation the pool would not keep
+    int Estimate() {
+        int size = (int)average_size;
+        return size > ClassSize(POOL_CLASSES - 1) ? ClassSize(POOL_CLASSES - 1) : size;
+    }
+
+    Handle<Value> Configure(const Arguments &args) {
+        HandleScope scope;
+        if (!args[0]->IsObject()) {
+            return ThrowException(Exception::TypeError(String::New("Pool options must be an object")));
+        }
+        Local<Object> opts = args[0]->ToObject();
+        Local<String> max_bytes_sym = String::NewSymbol("maxBytes");
+        Local<String> max_buffers_sym = String::NewSymbol("maxBuffers");
+        Local<String> idle_timeout_sym = String::NewSymbol("idleTimeout");
+
+        if (opts->Has(max_bytes_sym)) {
+            max_bytes = opts->Get(max_bytes_sym)->Uint32Value();
+        }
+        if (opts->Has(max_buffers_sym)) {
+            max_buffers = opts->Get(max_buffers_sym)->Uint32Value();
+            for (int c = 0; c < POOL_CLASSES; c++) {
+                while (free_lists[c].size() > max_buffers) {
+                    Drop(c);
+                }
+            }
+        }
+        if (opts->Has(idle_timeout_sym)) {
+            idle_timeout = opts->Get(idle_timeout_sym)->NumberValue() / 1000;
+            StopTimer();
+            if (pooled_bytes > 0) StartTimer();
+        }
+        Trim(max_bytes);
+
+        return Undefined();
+    }
+
+    Handle<Value> Stats(const Arguments &args) {
+        HandleScope scope;
+        size_t buffers = 0;
+        for (int c = 0; c < POOL_CLASSES; c++) {
+            buffers += free_lists[c].size();
+        }
+
+        Local<Object> stats = Object::New();
+        stats->Set(String::NewSymbol("buffers"), Number::New(buffers));
+        stats->Set(String::NewSymbol("bytes"), Number::New(pooled_bytes));
+        stats->Set(String::NewSymbol("hits"), Number::New(hits));
+        stats->Set(String::NewSymbol("misses"), Number::New(misses));
+
+        return scope.Close(stats);
+    }
+}
+
+void InitPool(Handle<Object> target) {
+    HandleScope scope;
+
+    ev_init(&GeneratorPool::idle_timer, GeneratorPool::OnIdle);
+
+    target->Set(String::NewSymbol("configurePool"),
+        FunctionTemplate::New(GeneratorPool::Configure)->GetFunction());
+    target->Set(String::NewSymbol("poolStats"),
+        FunctionTemplate::New(GeneratorPool::Stats)->GetFunction());
+}
@@ -0,0 +1,21 @@
+#ifndef _POOL_H
+#define	_POOL_H
+
+#include <v8.h>
+
+void InitPool(v8::Handle<v8::Object> target);
+
+namespace GeneratorPool {
+    // Returns a malloc'd buffer of at least size bytes; its real size is
+    // stored in capacity.
+    char *Acquire(int size, int *capacity);
+    // Takes a buffer back. Encoded Buffers come back only when the garbage
+    // collector frees them, so reuse follows collection.
+    void Release(char *buf, int capacity);
+    // Remembers the size of a finished document to size the next Acquire
+    void Record(int size);
+    // A decaying average of recorded sizes
+    int Estimate();
+}
+
+#endif	/* _POOL_H */
@@ -1,4 +1,5 @@
 #include <node.h>
+#include <node_buffer.h>
 #include <v8.h>
 #include <bson.h>
 #include "types.h"
@@ -18,74 +19,217 @@ static Persistent<String> id_sym;
 static Persistent<String> scope_sym;
 static Persistent<String> code_sym;
 
+// The 12 bytes of an ObjectID live in its internal fields, three bytes to a
+// field so each one is a small integer on every platform. Nothing is
+// allocated to read or write them.
+#define OID_FIELDS 4
+
 namespace ObjectID {
     PERSIST_TEMPLATE
 
-    Handle<Value> New(bson_oid_t *oid) {
+    static Persistent<ObjectTemplate> instance_template;
+
+    // An object can inherit from ObjectID.prototype, and so reach these
+    // methods, without having the internal fields; V8 aborts on any access
+    // to a field an object does not have
+    static inline bool HasFields(Handle<Object> obj) {
+        return obj->InternalFieldCount() >= OID_FIELDS;
+    }
+
+    static inline Handle<Value> NotAnObjectID() {
+        return ThrowException(Exception::TypeError(String::New("Object is not an ObjectID")));
+    }
+
+    static inline void Store(Handle<Object> obj, const bson_oid_t *oid) {
+        const unsigned char *b = (const unsigned char *)oid->bytes;
+        for (int i = 0; i < OID_FIELDS; i++, b += 3) {
+            obj->SetInternalField(i, Integer::New((b[0] << 16) | (b[1] << 8) | b[2]));
+        }
+    }
+
+    bool Load(Handle<Object> obj, bson_oid_t *oid) {
+        if (!HasFields(obj)) return false;
+        unsigned char *b = (unsigned char *)oid->bytes;
+        for (int i = 0; i < OID_FIELDS; i++, b += 3) {
+            int32_t v = obj->GetInternalField(i)->Int32Value();
+            b[0] = v >> 16;
+            b[1] = v >> 8;
+            b[2] = v;
+        }
+        return true;
+    }
+
+    bool IsPrototype(Handle<Value> val) {
+        return val->StrictEquals(constructor_template->GetFunction()->Get(String::NewSymbol("prototype")));
+    }
+
+    Handle<Value> New(const bson_oid_t *oid) {
         HandleScope scope;
 
-        Local<Value> arg = External::New((void *)oid);
-        Local<Object> b = constructor_template->GetFunction()->NewInstance(1, &arg);
+        Local<Object> b = instance_template->NewInstance();
+        Store(b, oid);
 
         return scope.Close(b);
     }
 
+    // The raw bytes as a binary string, as the id property used to hold them
+    Handle<Value> GetId(Local<String> property, const AccessorInfo &info) {
+        HandleScope scope;
+        bson_oid_t oid;
+        if (!Load(info.This(), &oid)) return NotAnObjectID();
+        return scope.Close(node::Encode(oid.bytes, 12, node::BINARY));
+    }
+
+    void SetId(Local<String> property, Local<Value> value, const AccessorInfo &info) {
+        HandleScope scope;
+        bson_oid_t oid;
+        if (!HasFields(info.This())) {
+            NotAnObjectID();
+            return;
+        }
+        if (node::DecodeBytes(value, node::BINARY) != 12) {
+            ThrowException(Exception::TypeError(String::New("ObjectID must be 12 bytes")));
+            return;
+        }
+        node::DecodeWrite(oid.bytes, 12, value, node::BINARY);
+        Store(info.This(), &oid);
+    }
+
     Handle<Value> ToUtf8String(const Arguments &args) {
         HandleScope scope;
-        Local<Value> id = args.This()->Get(id_sym);
-        return scope.Close(id);
+        bson_oid_t oid;
+        if (!Load(args.This(), &oid)) return NotAnObjectID();
+        return scope.Close(node::Encode(oid.bytes, 12, node::BINARY));
     }
     
-    Handle<Value> ToHexString(const Arguments &args) {
-        HandleScope scope;
-        Local<Value> id = args.This()->Get(id_sym);
+    // Only for objects with the fields
+    static inline Local<String> HexString(Handle<Object> obj) {
         bson_oid_t oid;
-        node::DecodeWrite(oid.bytes, 12, id, node::BINARY);
         char hex[25];
+        Load(obj, &oid);
         bson_oid_to_string(&oid, hex);
-        return scope.Close(String::New(hex));
+        return String::New(hex, 24);
     }
-    
-    Handle<Value> ToTimestamp(const Arguments &args) {
+
+    // Parses a 24 digit hex string, returning false for anything else
+    static bool ParseHex(Handle<Value> val, bson_oid_t *oid) {
+        if (!val->IsString()) return false;
+        Local<String> str = val->ToString();
+        if (str->Length() != 24) return false;
+
+        uint16_t wide[25];
+        char hex[24];
+        str->Write(wide, 0, 24);
+        for (int i = 0; i < 24; i++) {
+            if (wide[i] > 0x7f) return false;
+            hex[i] = wide[i];
+        }
+        return bson_oid_from_string(oid, hex);
+    }
+
+    Handle<Value> ToHexString(const Arguments &args) {
         HandleScope scope;
-        Local<Value> id = args.This()->Get(id_sym);
-        char buf[12];
-        node::DecodeWrite(buf, 12, id, node::BINARY);
-        time_t foo = bson_oid_generated_time((bson_oid_t *)buf);
-        return Integer::New(foo);
+        if (!HasFields(args.This())) return NotAnObjectID();
+        return scope.Close(HexString(args.This()));
     }
 
-    Handle<Value> Generate() {
+    // ObjectID.fromHexArray(strings) converts a whole array in one call
+    Handle<Value> FromHexArray(const Arguments &args) {
+        HandleScope scope;
+        if (!args[0]->IsArray()) {
+            return ThrowException(Exception::TypeError(String::New("Argument must be an array")));
+        }
+        Local<Array> strings = Local<Array>::Cast(args[0]);
+        uint32_t length = strings->Length();
+        Local<Array> ids = Array::New(length);
         bson_oid_t oid;
-        bson_oid_gen(&oid);
-        return node::Encode(oid.bytes, 12, node::BINARY);
+
+        for (uint32_t i = 0; i < length; i++) {
+            HandleScope inner;
+            if (!ParseHex(strings->Get(i), &oid)) {
+                return ThrowException(Exception::TypeError(String::New("Invalid hex string")));
+            }
+            Local<Object> id = instance_template->NewInstance();
+            Store(id, &oid);
+            ids->Set(i, id);
+        }
+        return scope.Close(ids);
     }
 
-    Handle<Value> FromHexString(Local<String> hex) {
-        bson_oid_t oid;
-        bson_oid_from_string(&oid, (const char *) *String::Utf8Value(hex));
-        return node::Encode(oid.bytes, 12, node::BINARY);
+    // ObjectID.toHexArray(ids) is the reverse of fromHexArray
+    Handle<Value> ToHexArray(const Arguments &args) {
+        HandleScope scope;
+        if (!args[0]->IsArray()) {
+            return ThrowException(Exception::TypeError(String::New("Argument must be an array")));
+        }
+        Local<Array> ids = Local<Array>::Cast(args[0]);
+        uint32_t length = ids->Length();
+        Local<Array> strings = Array::New(length);
+
+        for (uint32_t i = 0; i < length; i++) {
+            HandleScope inner;
+            Local<Value> id = ids->Get(i);
+            if (!HasInstance(id) || !HasFields(id->ToObject())) {
+                return ThrowException(Exception::TypeError(String::New("Array must only contain ObjectIDs")));
+            }
+            strings->Set(i, HexString(id->ToObject()));
+        }
+        return scope.Close(strings);
+    }
+
+    // The first four bytes are the big-endian creation time in seconds
+    Handle<Value> ToTimestamp(const Arguments &args) {
+        HandleScope scope;
+        if (!HasFields(args.This())) return NotAnObjectID();
+        uint32_t high = args.This()->GetInternalField(0)->Uint32Value();
+        uint32_t low = args.This()->GetInternalField(1)->Uint32Value();
+        return scope.Close(Integer::NewFromUnsigned((high << 8) | (low >> 16)));
+    }
+
+    Handle<Value> Equals(const Arguments &args) {
+        HandleScope scope;
+        if (!HasFields(args.This())) return NotAnObjectID();
+        if (!HasInstance(args[0]) || !HasFields(args[0]->ToObject())) {
+            return False();
+        }
+        Local<Object> other = args[0]->ToObject();
+        for (int i = 0; i < OID_FIELDS; i++) {
+            if (args.This()->GetInternalField(i)->Int32Value() != other->GetInternalField(i)->Int32Value()) {
+                return False();
+            }
+        }
+        return True();
     }
 
-    Handle<Value> FromExternal(Local<Value> val) {
-        bson_oid_t *oid = (bson_oid_t *)External::Unwrap(val);
-        return node::Encode(oid->bytes, 12, node::BINARY);
+    // ObjectID.generateBatch(n) returns a Buffer of n new ids, 12 bytes each.
+    // n is at most 2^24 so that no id repeats within the batch, and the
+    // clock is read once for the whole batch.
+    Handle<Value> GenerateBatch(const Arguments &args) {
+        HandleScope scope;
+        int64_t count = args[0]->IntegerValue();
+        if (!args[0]->IsNumber() || count < 0 || count > BSON_OID_BATCH_MAX) {
+            return ThrowException(Exception::RangeError(String::New("Invalid number of ids")));
+        }
+        Buffer *buf = Buffer::New(count * 12);
+        bson_oid_gen_batch((bson_oid_t *)Buffer::Data(buf), count, time(NULL));
+        return scope.Close(buf->handle_);
     }
 
+    // Called without new, This() is the receiver rather than a fresh
+    // instance, so one is made from the template instead
     Handle<Value> New(const Arguments &args) {
         HandleScope scope;
+        bson_oid_t oid;
 
         if (args.Length() == 0) {
-            args.This()->Set(id_sym, Generate());
-        } else if (args[0]->IsString() && args[0]->ToString()->Length() == 24) {
-            args.This()->Set(id_sym, FromHexString(args[0]->ToString()));
-        } else if (args[0]->IsExternal()) {
-            args.This()->Set(id_sym, FromExternal(args[0]));
-        } else {
+            bson_oid_gen(&oid);
+        } else if (!ParseHex(args[0], &oid)) {
             return ThrowException(Exception::TypeError(String::New("Invalid hex string")));
         }
+        Local<Object> self = args.IsConstructCall() ? args.This() : instance_template->NewInstance();
+        Store(self, &oid);
 
-        return args.This();
+        return scope.Close(self);
     }
 
     void Setup(Handle<Object> target) {
@@ -94,14 +238,22 @@ namespace ObjectID {
         Local<FunctionTemplate> t = FunctionTemplate::New(ObjectID::New);
         constructor_template = Persistent<FunctionTemplate>::New(t);
         constructor_template->SetClassName(String::NewSymbol("ObjectID"));
+        constructor_template->InstanceTemplate()->SetInternalFieldCount(OID_FIELDS);
+        constructor_template->InstanceTemplate()->SetAccessor(id_sym, GetId, SetId);
 
         NODE_SET_PROTOTYPE_METHOD(constructor_template, "inspect", ObjectID::ToHexString);
         NODE_SET_PROTOTYPE_METHOD(constructor_template, "toString", ObjectID::ToHexString);
         NODE_SET_PROTOTYPE_METHOD(constructor_template, "toUtf8String", ObjectID::ToUtf8String);
         NODE_SET_PROTOTYPE_METHOD(constructor_template, "toHexString", ObjectID::ToHexString);
         NODE_SET_PROTOTYPE_METHOD(constructor_template, "toTimestamp", ObjectID::ToTimestamp);
+        NODE_SET_PROTOTYPE_METHOD(constructor_template, "equals", ObjectID::Equals);
+        NODE_SET_METHOD(constructor_template, "fromHexArray", ObjectID::FromHexArray);
+        NODE_SET_METHOD(constructor_template, "toHexArray", ObjectID::ToHexArray);
+        NODE_SET_METHOD(constructor_template, "generateBatch", ObjectID::GenerateBatch);
 
         target->Set(String::NewSymbol("ObjectID"), constructor_template->GetFunction());
+        // Instances made from the template skip the constructor call
+        instance_template = Persistent<ObjectTemplate>::New(constructor_template->InstanceTemplate());
     }
 }
 
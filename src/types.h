@@ -8,7 +8,12 @@ void InitTypes(v8::Handle<v8::Object> target);
 
 namespace ObjectID {
     bool HasInstance(v8::Handle<v8::Value> obj);
-    v8::Handle<v8::Value> New(bson_oid_t *oid);
+    v8::Handle<v8::Value> New(const bson_oid_t *oid);
+    // Whether val is ObjectID.prototype
+    bool IsPrototype(v8::Handle<v8::Value> val);
+    // Copies the 12 bytes of an ObjectID instance into oid, or returns false
+    // if obj does not hold them
+    bool Load(v8::Handle<v8::Object> obj, bson_oid_t *oid);
 }
 namespace Code {
     bool HasInstance(v8::Handle<v8::Value> obj);
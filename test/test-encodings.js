@@ -217,19 +217,28 @@ var comparisons = [
 var i = 0;
 comparisons.forEach(function (comp) {
     puts("Encode " + comp[0]);
-    assert.deepEqual(bson.encode(comp[1]), comp[2]);
+    assert.deepEqual(bson.encode(comp[1]).toString('binary'), comp[2]);
     puts("Decode " + comp[0]);
-    assert.deepEqual(bson.decode(comp[2]), comp[1]);
+    assert.deepEqual(bson.decode(new Buffer(comp[2], 'binary')), comp[1]);
+});
+
+// Test exact size calculation
+comparisons.forEach(function (comp) {
+    puts("Size " + comp[0]);
+    assert.strictEqual(bson.calculateObjectSize(comp[1]), comp[2].length);
+    assert.deepEqual(bson.encode(comp[1], {exactSize: true}).toString('binary'), comp[2]);
 });
 
 var regobj = {"reg": /foobar/i},
     regbson = "\x13\x00\x00\x00\x0breg\x00foobar\x00i\x00\x00";
 
 puts("Encode Regex");
-assert.deepEqual(bson.encode(regobj), regbson);
+assert.deepEqual(bson.encode(regobj).toString('binary'), regbson);
+
+assert.strictEqual(bson.calculateObjectSize(regobj), regbson.length);
 
 puts("Decode Regex");
-var regdecoded = bson.decode(regbson);
+var regdecoded = bson.decode(new Buffer(regbson, 'binary'));
 assert.strictEqual(regdecoded.source, regobj.source);
 assert.strictEqual(regdecoded.global, regobj.global);
 assert.strictEqual(regdecoded.ignoreCase, regobj.ignoreCase);
@@ -249,24 +258,292 @@ var dbrobj = {"dbref": new bson.DBRef('foo', new bson.ObjectID("1234567890123456
         "\x00";
 
 puts("Encode DBRef");
-assert.deepEqual(bson.encode(dbrobj), dbrbson);
+assert.deepEqual(bson.encode(dbrobj).toString('binary'), dbrbson);
 
 puts("Decode DBRef");
-var dbrdecoded = bson.decode(dbrbson);
+var dbrdecoded = bson.decode(new Buffer(dbrbson, 'binary'));
 assert.deepEqual(dbrdecoded, dbrobj);
 
 puts("Encode Binary");
 var binobj = {"bin": function() {var buf = new Buffer([1,2,3]); buf.bsonType = 0; return buf}()},
     binbson = "\x12\x00\x00\x00\x05bin\x00\x03\x00\x00\x00\x00\x01\x02\x03\x00";
-assert.strictEqual(bson.encode(binobj), binbson);
+assert.strictEqual(bson.encode(binobj).toString('binary'), binbson);
 
 puts("Decode Binary");
-assert.strictEqual(bson.decode(binbson).bin.toString(), binobj.bin.toString());
+assert.strictEqual(bson.decode(new Buffer(binbson, 'binary')).bin.toString(), binobj.bin.toString());
 
 puts("Encode Binary type 2");
 var binobj2 = {"bin": function() {var buf = new Buffer([1,2,3]); buf.bsonType = 2; return buf}()},
     binbson2 = "\x16\x00\x00\x00\x05bin\x00\x07\x00\x00\x00\x02\x03\x00\x00\x00\x01\x02\x03\x00";
-assert.strictEqual(bson.encode(binobj2), binbson2);
+assert.strictEqual(bson.encode(binobj2).toString('binary'), binbson2);
+
+assert.strictEqual(bson.calculateObjectSize(binobj2), binbson2.length);
 
 puts("Decode Binary type 2");
-assert.strictEqual(bson.decode(binbson2).bin.toString(), binobj2.bin.toString());
\ No newline at end of file
+assert.strictEqual(bson.decode(new Buffer(binbson2, 'binary')).bin.toString(), binobj2.bin.toString());
+
+puts("Encode strings and keys with NUL");
+var nulobj = {"s": "a\u0000b", "c": new bson.Code("a\u0000b", {})},
+    nulbson = "\x24\x00\x00\x00" +
+              "\x02s\x00\x04\x00\x00\x00a\x00b\x00" +
+              "\x0fc\x00\x11\x00\x00\x00\x04\x00\x00\x00a\x00b\x00\x05\x00\x00\x00\x00" +
+              "\x00";
+assert.strictEqual(bson.calculateObjectSize(nulobj), nulbson.length);
+assert.strictEqual(bson.encode(nulobj).toString('binary'), nulbson);
+assert.strictEqual(bson.encode(nulobj, {exactSize: true}).toString('binary'), nulbson);
+assert.strictEqual(bson.decode(new Buffer(nulbson, 'binary')).s, "a\u0000b");
+assert.throws(function() { bson.encode({"a\u0000b": 1}) }, TypeError);
+assert.throws(function() { bson.calculateObjectSize({"a\u0000b": 1}) }, TypeError);
+assert.throws(function() { bson.encode({"r": new RegExp("a\u0000b")}) }, TypeError);
+assert.throws(function() { bson.calculateObjectSize({"r": new RegExp("a\u0000b")}) }, TypeError);
+
+puts("Decode with offset and length");
+var framed = new Buffer("\xff\xff" + comparisons[4][2] + "\xff", 'binary');
+assert.deepEqual(bson.decode(framed, 2, comparisons[4][2].length), comparisons[4][1]);
+
+puts("Encode into buffer");
+var target = new Buffer(64), written;
+written = bson.encodeInto(comparisons[4][1], target, 3);
+assert.strictEqual(written, comparisons[4][2].length);
+assert.strictEqual(target.toString('binary', 3, 3 + written), comparisons[4][2]);
+
+puts("Encode with pool limits");
+bson.configurePool({maxBytes: 0});
+assert.strictEqual(bson.poolStats().bytes, 0);
+assert.deepEqual(bson.encode(comparisons[4][1]).toString('binary'), comparisons[4][2]);
+bson.configurePool({maxBytes: 8 * 1024 * 1024});
+
+puts("Decode with key cache");
+var keydoc = new Buffer(comparisons[1][2], 'binary'),
+    hits = bson.keyCacheStats().hits;
+bson.decode(keydoc);
+bson.decode(keydoc);
+assert.ok(bson.keyCacheStats().hits >= hits + 2);
+bson.configureKeyCache({size: 0});
+assert.deepEqual(bson.decode(keydoc), comparisons[1][1]);
+assert.strictEqual(bson.keyCacheStats().capacity, 0);
+bson.configureKeyCache({size: 1024});
+
+puts("Round trip large array");
+var series = [];
+for (var n = 0; n < 1500; n++) series.push(n % 2 ? n : {v: n});
+var seriesdecoded = bson.decode(bson.encode({series: series})).series;
+assert.ok(Array.isArray(seriesdecoded));
+assert.strictEqual(seriesdecoded.length, series.length);
+assert.deepEqual(seriesdecoded, series);
+
+puts("Decode sparse array");
+// Array elements keep the index their key gives, as written by other drivers
+var sparsebson = new Buffer("\x1b\x00\x00\x00" +
+                            "\x04a\x00\x13\x00\x00\x00" +
+                            "\x10" + "0\0" + "\x01\x00\x00\x00" +
+                            "\x10" + "2\0" + "\x02\x00\x00\x00" +
+                            "\x00" +
+                            "\x00", 'binary'),
+    sparse = bson.decode(sparsebson).a;
+assert.strictEqual(sparse.length, 3);
+assert.strictEqual(sparse[0], 1);
+assert.ok(!(1 in sparse));
+assert.strictEqual(sparse[2], 2);
+assert.strictEqual(bson.get(sparsebson, 'a.2'), 2);
+
+puts("Decode with projection");
+var projdoc = bson.encode({
+  _id: 1,
+  name: 'order',
+  customer: {name: 'bob', address: {city: 'paris', zip: '75001'}},
+  lines: [{sku: 'a', qty: 1}, {sku: 'b', qty: 2}, 3],
+  notes: {long: 'text'}
+});
+assert.deepEqual(bson.decode(projdoc, {fields: {_id: 1, 'customer.address.city': 1, 'lines.sku': 1}}), {
+  _id: 1,
+  customer: {address: {city: 'paris'}},
+  lines: [{sku: 'a'}, {sku: 'b'}]
+});
+assert.deepEqual(bson.decode(projdoc, {fields: {customer: 1}}).customer.address.zip, '75001');
+assert.deepEqual(bson.decode(projdoc, {fields: {missing: 1}}), {});
+assert.strictEqual(bson.decode(projdoc, {fields: {}}).name, 'order');
+assert.deepEqual(bson.decode(projdoc, 0, projdoc.length, {fields: {name: 1}}), {name: 'order'});
+
+puts("Get path without decoding");
+assert.strictEqual(bson.get(projdoc, '_id'), 1);
+assert.strictEqual(bson.get(projdoc, 'customer.address.city'), 'paris');
+assert.strictEqual(bson.get(projdoc, 'lines.1.qty'), 2);
+assert.deepEqual(bson.get(projdoc, 'lines.0'), {sku: 'a', qty: 1});
+assert.strictEqual(bson.get(projdoc, 'lines').length, 3);
+assert.strictEqual(bson.get(projdoc, 'name.first'), undefined);
+assert.strictEqual(bson.get(projdoc, 'nothing'), undefined);
+assert.deepEqual(bson.getMany(projdoc, ['_id', 'lines.2', 'nothing']), [1, 3, undefined]);
+
+puts("Decode many");
+var many = new Buffer(comparisons[1][2] + comparisons[4][2] + comparisons[6][2] + "\x20\x00", 'binary'),
+    manyresult = bson.decodeMany(many);
+assert.deepEqual(manyresult.documents, [comparisons[1][1], comparisons[4][1], comparisons[6][1]]);
+assert.strictEqual(manyresult.offset, many.length - 2);
+manyresult = bson.decodeMany(many, comparisons[1][2].length, 1, {fields: {hello: 1}});
+assert.deepEqual(manyresult.documents, [comparisons[4][1]]);
+assert.strictEqual(manyresult.offset, comparisons[1][2].length + comparisons[4][2].length);
+
+puts("Encode many");
+var batch = bson.encodeMany([comparisons[1][1], comparisons[4][1], comparisons[6][1]]);
+assert.strictEqual(batch.buffer.toString('binary'), comparisons[1][2] + comparisons[4][2] + comparisons[6][2]);
+assert.deepEqual(batch.offsets, [0, comparisons[1][2].length, comparisons[1][2].length + comparisons[4][2].length]);
+assert.deepEqual(bson.decodeMany(batch.buffer).documents, [comparisons[1][1], comparisons[4][1], comparisons[6][1]]);
+batch = bson.encodeMany([comparisons[4][1]], {exactSize: true});
+assert.strictEqual(batch.buffer.toString('binary'), comparisons[4][2]);
+assert.strictEqual(bson.encodeMany([]).buffer.length, 0);
+
+puts("Decode async");
+comparisons.forEach(function (comp) {
+    bson.decodeAsync(new Buffer(comp[2], 'binary'), function(err, doc) {
+        assert.ifError(err);
+        assert.deepEqual(doc, comp[1]);
+    });
+});
+bson.decodeAsync(new Buffer("\x05\x00\x00\x00\x01", 'binary'), function(err, doc) {
+    assert.ok(err instanceof Error);
+});
+
+puts("Validate");
+comparisons.forEach(function (comp) {
+    var buf = new Buffer(comp[2], 'binary');
+    assert.ok(bson.validate(buf));
+    assert.deepEqual(bson.decode(buf, {trusted: true}), comp[1]);
+});
+assert.ok(bson.validate(projdoc, {maxDepth: 3}));
+assert.ok(!bson.validate(projdoc, {maxDepth: 2}));
+assert.ok(bson.validate(many, 0, comparisons[1][2].length));
+assert.ok(bson.validate(many, comparisons[1][2].length, comparisons[4][2].length));
+assert.deepEqual(bson.decodeMany(many, 0, 3, {trusted: true}).documents, [comparisons[1][1], comparisons[4][1], comparisons[6][1]]);
+
+puts("Decoder stream");
+var streamed = [],
+    stream = new bson.DecoderStream();
+stream.on('document', function(doc) { streamed.push(doc); });
+for (var pos = 0; pos < many.length - 2; pos += 3) {
+    stream.write(many.slice(pos, Math.min(pos + 3, many.length - 2)));
+}
+stream.end();
+assert.deepEqual(streamed, [comparisons[1][1], comparisons[4][1], comparisons[6][1]]);
+var decoder = new bson.Decoder();
+assert.deepEqual(decoder.write(many), [comparisons[1][1], comparisons[4][1], comparisons[6][1]]);
+assert.strictEqual(decoder.pending, 2);
+
+puts("Encode chunked");
+comparisons.forEach(function (comp) {
+    var chunks = [];
+    assert.strictEqual(bson.encodeChunked(comp[1], function(chunk) {
+        assert.ok(chunk.length <= 64);
+        chunks.push(chunk.toString('binary'));
+    }, {chunkSize: 64}), comp[2].length);
+    assert.strictEqual(chunks.join(''), comp[2]);
+});
+var chunked = [];
+bson.encodeToStream({big: new Array(300).join('long string '), list: series, order: bson.decode(projdoc)}, {
+    write: function(chunk) { chunked.push(chunk.toString('binary')); }
+}, {chunkSize: 100});
+assert.strictEqual(chunked.join(''), bson.encode({big: new Array(300).join('long string '), list: series, order: bson.decode(projdoc)}).toString('binary'));
+
+var Stream = require('stream').Stream,
+    slow = new Stream(),
+    pending = [],
+    written = [],
+    finished = false,
+    bigdoc = {big: new Array(300).join('long string '), list: series};
+// Accepts one chunk per drain
+slow.write = function(chunk) { pending.push(chunk.toString('binary')); return false; };
+assert.strictEqual(bson.encodeToStream(bigdoc, slow, {chunkSize: 100}, function(err) {
+    assert.ifError(err);
+    finished = true;
+}), bson.calculateObjectSize(bigdoc));
+while (!finished) {
+    assert.strictEqual(pending.length, 1);
+    written.push(pending.shift());
+    slow.emit('drain');
+}
+assert.strictEqual(pending.length, 0);
+assert.strictEqual(written.join(''), bson.encode(bigdoc).toString('binary'));
+var pulldoc = {list: series, code: new bson.Code("this.x == 3", {a: [1, {b: [2]}]}), empty: {}},
+    pulled = [], encoder = new bson.ChunkedEncoder(pulldoc, {chunkSize: 64}), chunk;
+while ((chunk = encoder.next()) !== null) pulled.push(chunk.toString('binary'));
+assert.strictEqual(pulled.join(''), bson.encode(pulldoc).toString('binary'));
+assert.strictEqual(encoder.next(), null);
+// asBSON runs once per value although the size pass comes first, and
+// strings keep their NULs
+var calls = 0,
+    counted = {s: "a\u0000b", v: {asBSON: function() { calls++; return {n: calls}; }}},
+    countedbson = bson.encode({s: "a\u0000b", v: {n: 1}}).toString('binary'),
+    countedchunks = [];
+assert.strictEqual(bson.encodeChunked(counted, function(chunk) {
+    countedchunks.push(chunk.toString('binary'));
+}, {chunkSize: 64}), countedbson.length);
+assert.strictEqual(calls, 1);
+assert.strictEqual(countedchunks.join(''), countedbson);
+calls = 0;
+countedchunks = [];
+encoder = new bson.ChunkedEncoder(counted, {chunkSize: 64});
+while ((chunk = encoder.next()) !== null) countedchunks.push(chunk.toString('binary'));
+assert.strictEqual(calls, 1);
+assert.strictEqual(countedchunks.join(''), countedbson);
+assert.throws(function() { new bson.ChunkedEncoder({"a\u0000b": 1}) }, TypeError);
+
+puts("Encode dispatch by prototype");
+function Point(x, y) { this.x = x; this.y = y; }
+function Wrapped(value) { this.value = value; }
+Wrapped.prototype.asBSON = function() { return this.value; };
+var mixed = [{a: 1}, new Point(1, 2), new Wrapped('w'), {asBSON: 5}, /re/g, {b: new Point(3, 4)}],
+    mixedbson = bson.encode({list: mixed});
+assert.deepEqual(bson.decode(mixedbson), {list: [{a: 1}, {x: 1, y: 2}, 'w', 5, /re/g, {b: {x: 3, y: 4}}]});
+assert.strictEqual(bson.calculateObjectSize({list: mixed}), mixedbson.length);
+assert.deepEqual(bson.decode(bson.encode({list: mixed})), bson.decode(mixedbson));
+// An object that only inherits from a type's prototype must not decide how
+// real instances encode
+var hollowcode = Object.create(bson.Code.prototype), realcode = new bson.Code("this.x == 3");
+hollowcode.code = 'x';
+bson.encode({c: hollowcode});
+assert.deepEqual(bson.decode(bson.encode({c: realcode})).c, realcode);
+assert.throws(function() { bson.encode({_id: Object.create(bson.ObjectID.prototype)}) }, TypeError);
+var realid = new bson.ObjectID("123456789012345678901234");
+assert.strictEqual(bson.decode(bson.encode({_id: realid}))._id.toHexString(), realid.toHexString());
+
+puts("Compiled encoder");
+var event = {type: 'click', at: new Date(1300000000000), user: new bson.ObjectID("123456789012345678901234"),
+             pos: {x: 1, y: 2.5}, tags: ['a'], ok: true, none: null};
+var compiled = bson.compileEncoder(event);
+assert.strictEqual(compiled.encode(event).toString('binary'), bson.encode(event).toString('binary'));
+var other = {type: 'move', at: new Date(), user: new bson.ObjectID(), pos: {x: 3.5, y: -1}, tags: [], ok: false, none: null};
+assert.strictEqual(compiled.encode(other).toString('binary'), bson.encode(other).toString('binary'));
+assert.strictEqual(compiled.fallbacks, 0);
+var drifted = {type: 7, at: new Date(), pos: {x: 'far'}, ok: true};
+assert.strictEqual(compiled.encode(drifted).toString('binary'), bson.encode(drifted).toString('binary'));
+assert.strictEqual(compiled.fallbacks, 1);
+var extra = {type: 'drop', at: new Date(), user: new bson.ObjectID(), pos: {x: 0, y: 0, z: 1}, tags: [], ok: true, none: null, more: 1},
+    reordered = {at: new Date(), type: 'drop', user: new bson.ObjectID(), pos: {x: 0, y: 0}, tags: [], ok: true, none: null};
+assert.deepEqual(bson.decode(compiled.encode(extra)), extra);
+assert.strictEqual(compiled.encode(reordered).toString('binary'), bson.encode(reordered).toString('binary'));
+assert.strictEqual(compiled.fallbacks, 3);
+// A mismatch after a field the template leaves untyped is found before that
+// field is encoded, so its asBSON runs once
+var tagcalls = 0,
+    late = {type: 'late', at: new Date(), user: new bson.ObjectID(), pos: {x: 0, y: 0},
+            tags: {asBSON: function() { tagcalls++; return ['t']; }}, ok: 'no', none: null};
+assert.deepEqual(bson.decode(compiled.encode(late)).tags, ['t']);
+assert.strictEqual(tagcalls, 1);
+assert.strictEqual(compiled.fallbacks, 4);
+assert.throws(function() { bson.compileEncoder('nope') });
+
+puts("Decode repeated shapes");
+var shaped = [{b: 1, a: {y: 'y', x: null}}, {b: 2, a: {y: 'z', x: [1]}}, {b: 3, a: {y: '', x: true}},
+              {'0': 'index', b: 4}],
+    shapedbson = bson.encodeMany(shaped).buffer,
+    shapeddecoded = bson.decodeMany(shapedbson).documents;
+assert.deepEqual(shapeddecoded.slice(0, 3), shaped.slice(0, 3));
+assert.deepEqual(shapeddecoded.map(function(doc) { return Object.keys(doc); }),
+                 shaped.map(function(doc) { return Object.keys(doc); }));
+assert.deepEqual(Object.keys(shapeddecoded[2].a), ['y', 'x']);
+shapeddecoded[1].c = 1;
+assert.deepEqual(bson.decode(bson.encode(shaped[1])), shaped[1]);
+assert.deepEqual(bson.decodeMany(shapedbson, {fields: {'a.y': 1}}).documents[1], {a: {y: 'z'}});
+// Names whose hashes collide share a cache slot but not a shape
+var colliding = [{glbvs: 1}, {glbvs: 2}, {yacxa: 3}];
+assert.deepEqual(bson.decodeMany(bson.encodeMany(colliding).buffer).documents, colliding);
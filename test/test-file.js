@@ -0,0 +1,102 @@
+require('./common');
+
+var bson = require('bson_ext'),
+    fs = require('fs'),
+    Buffer = require('buffer').Buffer;
+
+var path = '/tmp/bson-ext-test-' + process.pid + '.bson',
+    docs = [{a: 1}, {hello: 'world', n: [1, 2, 3]}, {nested: {deep: {x: 'y'}}}];
+
+fs.writeFileSync(path, bson.encodeMany(docs).buffer);
+
+puts("Read documents");
+var file = new bson.BSONFile(path), doc, read = [];
+while ((doc = file.next()) !== null) read.push(doc);
+assert.deepEqual(read, docs);
+assert.strictEqual(file.offset, file.size);
+
+puts("Read buffers");
+file.seek(0);
+var slice = file.nextBuffer();
+assert.strictEqual(slice.toString('binary'), bson.encode(docs[0]).toString('binary'));
+file.close();
+assert.deepEqual(bson.decode(slice), docs[0]);
+assert.throws(function() { file.next() });
+
+puts("Read with options");
+file = new bson.BSONFile(path, {fields: {hello: 1}});
+file.next();
+assert.deepEqual(file.next(), {hello: 'world'});
+file.close();
+
+puts("Read truncated file");
+fs.writeFileSync(path, bson.encode(docs[1]).slice(0, 10));
+file = new bson.BSONFile(path);
+assert.throws(function() { file.next() });
+file.close();
+assert.throws(function() { new bson.BSONFile(path + '.missing') });
+
+puts("Write documents");
+var writer = new bson.BSONWriter(path, {bufferSize: 4096});
+assert.strictEqual(writer.write(docs[0]), 0);
+writer.write(docs[1]);
+writer.write({big: new Array(1000).join('0123456789')});
+writer.write(docs[2]);
+writer.close();
+var written = fs.readFileSync(path);
+assert.strictEqual(written.length, writer.offset);
+assert.strictEqual(bson.decodeMany(written).documents.length, 4);
+assert.throws(function() { writer.write(docs[0]) });
+
+// Documents that only fit an emptied buffer, and one larger than the buffer
+var halves = [], offsets = [];
+for (var h = 0; h < 3; h++) halves.push({h: h, pad: new Array(300).join('0123456789')});
+halves.push({h: 3, pad: new Array(500).join('0123456789')}, {h: 4, pad: ''});
+writer = new bson.BSONWriter(path, {bufferSize: 4096});
+halves.forEach(function(doc) { offsets.push(writer.write(doc)); });
+writer.close();
+written = fs.readFileSync(path);
+assert.deepEqual(bson.decodeMany(written).documents, halves);
+offsets.forEach(function(offset, i) { assert.deepEqual(bson.decode(written, offset), halves[i]); });
+
+writer = new bson.BSONWriter(path, {append: true, syncBytes: 1});
+assert.strictEqual(writer.write(docs[0]), written.length);
+writer.sync();
+writer.close();
+file = new bson.BSONFile(path);
+file.seek(written.length);
+assert.deepEqual(file.next(), docs[0]);
+file.close();
+
+puts("Build and query index");
+fs.writeFileSync(path, bson.encodeMany([
+  {n: 3, s: 'c'}, {n: -1.5, s: 'a'}, {x: 1}, {n: 3, s: 'd'}, {n: 10, s: 'b'}
+]).buffer);
+assert.deepEqual(bson.buildIndex(path, {field: 'n'}), {documents: 5, keys: 4});
+var index = new bson.BSONIndex(path);
+assert.strictEqual(index.count, 5);
+assert.strictEqual(index.field, 'n');
+assert.deepEqual(index.document(2), {x: 1});
+assert.deepEqual(index.find(3), [{n: 3, s: 'c'}, {n: 3, s: 'd'}]);
+assert.deepEqual(index.find(4), []);
+assert.deepEqual(index.range(-2, 3), [{n: -1.5, s: 'a'}]);
+assert.deepEqual(index.range(0, null, 2), [{n: 3, s: 'c'}, {n: 3, s: 'd'}]);
+assert.throws(function() { index.document(5) });
+index.close();
+
+// Damaged offsets throw rather than read outside the files
+var idx = fs.readFileSync(path + '.idx');
+idx[48 + 7] = 0x7f;
+fs.writeFileSync(path + '.idx', idx);
+index = new bson.BSONIndex(path);
+assert.throws(function() { index.document(0) }, /corrupt/);
+assert.throws(function() { index.offset(0) }, /corrupt/);
+index.close();
+idx[16 + 7] = 0x7f;
+fs.writeFileSync(path + '.idx', idx);
+assert.throws(function() { new bson.BSONIndex(path) }, /truncated/);
+
+fs.writeFileSync(path, bson.encode({n: 1}));
+assert.throws(function() { new bson.BSONIndex(path) });
+fs.unlinkSync(path + '.idx');
+fs.unlinkSync(path);
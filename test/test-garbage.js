@@ -1,6 +1,7 @@
 require('./common');
 
-var bson = require('bson_ext');
+var bson = require('bson_ext'),
+    Buffer = require('buffer').Buffer;
 
 puts("Encode bad args");
 assert.throws(function() { bson.encode() });
@@ -9,52 +10,174 @@ assert.throws(function() { bson.encode(undefined) });
 assert.throws(function() { bson.encode('value') });
 assert.throws(function() { bson.encode(true) });
 
+puts("Encode many bad args");
+assert.throws(function() { bson.encodeMany({}) });
+assert.throws(function() { bson.encodeMany([{}, 'value']) });
+
+puts("Encode into bad args");
+assert.throws(function() { bson.encodeInto({}, 'value') });
+assert.throws(function() { bson.encodeInto({}, new Buffer(5), 6) });
+
+puts("Encode into overflow");
+assert.throws(function() { bson.encodeInto({hello: 'world'}, new Buffer(21)) });
+assert.throws(function() { bson.encodeInto({}, new Buffer(8), 4) });
+assert.doesNotThrow(function() { bson.encodeInto({}, new Buffer(5)) });
+
+puts("Configure pool bad args");
+assert.throws(function() { bson.configurePool() });
+assert.throws(function() { bson.configurePool(5) });
+
 puts("Decode bad args");
 assert.throws(function() { bson.decode() });
 assert.throws(function() { bson.decode(null) });
 assert.throws(function() { bson.decode(undefined) });
 assert.throws(function() { bson.decode([]) });
 assert.throws(function() { bson.decode({}) });
+assert.throws(function() { bson.decode("\x05\x00\x00\x00\x00") });
+
+puts("Decode bad offsets");
+assert.throws(function() { bson.decode(new Buffer(5), 6) });
+assert.throws(function() { bson.decode(new Buffer(5), -1) });
+assert.throws(function() { bson.decode(new Buffer(5), 1, 5) });
+
+puts("Decode many past the end");
+assert.throws(function() { bson.decodeMany(new Buffer("\x05\x00\x00\x00\x00", 'binary'), 0, 2) });
+assert.throws(function() { bson.decodeMany(new Buffer("\x02\x00\x00\x00\x00", 'binary')) });
+
+puts("Get bad args");
+assert.throws(function() { bson.get("\x05\x00\x00\x00\x00", 'a') });
+assert.throws(function() { bson.get(new Buffer(5), 1) });
+assert.throws(function() { bson.getMany(new Buffer(5), 'a') });
+assert.throws(function() { bson.get(new Buffer("\x10\x00\x00\x00\x10hello", 'binary'), 'hello') });
 
 puts("Decode reported doc size > actual size");
 assert.doesNotThrow(function() {
-  bson.decode(
+  bson.decode(new Buffer(
       "\x99\x00\x00\x00"           +
       "\x10hello\x00"              +
       "\x01\x00\x00\x00"           +
-      "\x00")
+      "\x00", 'binary'))
     });
 
 puts("Decode reported doc size < actual size");
 assert.doesNotThrow(function() {
-  bson.decode(
+  bson.decode(new Buffer(
       "\x00\x00\x00\x00"           +
       "\x10hello\x00"              +
       "\x01\x00\x00\x00"           +
-      "\x00") 
+      "\x00", 'binary'))
     });
 
 puts("Decode nonexistent type");
 assert.throws(function() { 
-  bson.decode(
+  bson.decode(new Buffer(
       "\x00\x00\x00\x00"           +
       "\x69hello\x00"              +
       "\x01\x00\x00\x00"           +
-      "\x00")
+      "\x00", 'binary'))
 });
 
 puts("Decode wrong type");
 assert.throws(function() {
-  bson.decode(
+  bson.decode(new Buffer(
       "\x10\x00\x00\x00"           +
       "\x0fhello\x00"              +
       "\x01\x00\x00\x00"           +
-      "\x00")
+      "\x00", 'binary'))
 });
 
 puts("Decode partial");
 assert.throws(function() {
-  bson.decode(
+  bson.decode(new Buffer(
     "\x10\x00\x00\x00"             +
-    "\x10hello")
-});
\ No newline at end of file
+    "\x10hello", 'binary'))
+});
+puts("Decode invalid UTF-8");
+assert.throws(function() {
+  bson.decode(new Buffer(
+      "\x16\x00\x00\x00"           +
+      "\x02hello\x00"              +
+      "\x06\x00\x00\x00wor\xffd\x00" +
+      "\x00", 'binary'))
+});
+assert.throws(function() {
+  bson.decode(new Buffer(
+      "\x16\x00\x00\x00"           +
+      "\x02hel\xc0\xafo\x00"       +
+      "\x05\x00\x00\x00worl\x00"   +
+      "\x00", 'binary'))
+});
+
+puts("Decode unterminated string");
+assert.throws(function() {
+  bson.decode(new Buffer(
+      "\x16\x00\x00\x00"           +
+      "\x02hello\x00"              +
+      "\x06\x00\x00\x00worldx"     +
+      "\x00", 'binary'))
+});
+
+puts("Decode malformed binary");
+var negbin = new Buffer(
+      "\x0e\x00\x00\x00"           +
+      "\x05b\x00"                  +
+      "\xfb\xff\xff\xff\x00"        +
+      "\x00\x00\x00", 'binary');
+assert.throws(function() { bson.decode(negbin) });
+assert.throws(function() { bson.get(negbin, 'b') });
+var oldbin = new Buffer(
+      "\x15\x00\x00\x00"           +
+      "\x05b\x00"                  +
+      "\x07\x00\x00\x00\x02"        +
+      "\x7f\x00\x00\x00xyz"        +
+      "\x00", 'binary');
+assert.throws(function() { bson.decode(oldbin) });
+assert.throws(function() { bson.get(oldbin, 'b') });
+var asyncbin = false;
+bson.decodeAsync(new Buffer(oldbin.toString('binary'), 'binary'), function(err, doc) {
+  assert.ok(err);
+  asyncbin = true;
+});
+process.on('exit', function() { assert.ok(asyncbin); });
+oldbin[12] = 0x03;
+assert.doesNotThrow(function() { bson.decode(oldbin) });
+
+puts("Validate malformed");
+assert.ok(!bson.validate(new Buffer("\x06\x00\x00\x00\x00", 'binary')));
+assert.ok(!bson.validate(new Buffer("\x05\x00\x00\x00\x01", 'binary')));
+assert.ok(!bson.validate(new Buffer(
+    "\x16\x00\x00\x00"           +
+    "\x02hello\x00"              +
+    "\x07\x00\x00\x00world\x00"  +
+    "\x00", 'binary')));
+assert.throws(function() { bson.validate("\x05\x00\x00\x00\x00") });
+// trusted does not skip the checks for a buffer that was never validated
+assert.throws(function() {
+    bson.decode(new Buffer("\x0e\x00\x00\x00\x02a\x00\xff\x00\x00\x00x\x00\x00", 'binary'), {trusted: true});
+});
+// nor does it skip the bounds checks for a buffer changed after validation
+var changed = new Buffer("\x0e\x00\x00\x00\x02a\x00\x02\x00\x00\x00x\x00\x00", 'binary');
+assert.ok(bson.validate(changed));
+changed[7] = 0xff;
+assert.throws(function() { bson.decode(changed, {trusted: true}) });
+changed[7] = 0x02;
+changed[6] = 0x61;
+changed[8] = 0x61;
+assert.throws(function() { bson.decode(changed, {trusted: true}) });
+
+puts("Decode too deep");
+var deep = {};
+for (var d = 0; d < 40; d++) deep = {a: deep};
+assert.ok(!bson.validate(bson.encode(deep), {maxDepth: 100}));
+assert.throws(function() { bson.decode(bson.encode(deep)) });
+assert.throws(function() { bson.decode(bson.encode(deep), {trusted: true}) });
+
+puts("Decoder bad input");
+assert.throws(function() { new bson.Decoder().write("\x05\x00\x00\x00\x00") });
+assert.throws(function() { new bson.Decoder().write(new Buffer("\x02\x00\x00\x00\x00", 'binary')) });
+assert.throws(function() { new bson.Decoder({maxDocumentSize: 16}).write(new Buffer("\x20\x00\x00\x00", 'binary')) });
+
+puts("Encode chunked bad args");
+assert.throws(function() { bson.encodeChunked({a: 1}) });
+assert.throws(function() { bson.encodeChunked({a: 1}, function() { throw new Error('write failed'); }) }, /write failed/);
+assert.throws(function() { new bson.ChunkedEncoder('a') }, TypeError);
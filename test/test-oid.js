@@ -17,4 +17,45 @@ var o = new bson.ObjectID();
 assert.equal(o.toTimestamp(), Math.floor(new Date().valueOf()/1000));
 
 puts("ObjectID generationTime")
-assert.equal(o.generationTime, Math.floor(new Date().valueOf()/1000)*1000);
\ No newline at end of file
+assert.equal(o.generationTime, Math.floor(new Date().valueOf()/1000)*1000);
+
+puts("ObjectID equals and id");
+var a = new bson.ObjectID(oid_hex), b = bson.decode(bson.encode({_id: a}))._id;
+assert.ok(a.equals(b));
+assert.ok(!a.equals(new bson.ObjectID()));
+assert.ok(!a.equals(oid_hex));
+assert.strictEqual(b.id, a.toUtf8String());
+b.id = "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01";
+assert.strictEqual(b.toHexString(), "000000000000000000000001");
+assert.throws(function() { b.id = "short" });
+
+puts("ObjectID without new");
+var called = bson.ObjectID(oid_hex);
+assert.ok(called instanceof bson.ObjectID);
+assert.strictEqual(called.toHexString(), oid_hex);
+assert.ok(bson.ObjectID() instanceof bson.ObjectID);
+var hollow = Object.create(bson.ObjectID.prototype);
+assert.throws(function() { hollow.toHexString() }, TypeError);
+assert.throws(function() { hollow.toTimestamp() }, TypeError);
+assert.throws(function() { a.equals(hollow) || hollow.equals(a) }, TypeError);
+assert.throws(function() { bson.encode({_id: hollow}) }, TypeError);
+
+puts("ObjectID hex arrays");
+var hexes = [oid_hex, "abcdefABCDEF000000000000"];
+var ids = bson.ObjectID.fromHexArray(hexes);
+assert.ok(ids[0].equals(new bson.ObjectID(oid_hex)));
+assert.deepEqual(bson.ObjectID.toHexArray(ids), [oid_hex, "abcdefabcdef000000000000"]);
+assert.throws(function() { bson.ObjectID.fromHexArray([oid_hex, "12345678901234567890123g"]) });
+assert.throws(function() { bson.ObjectID.toHexArray([oid_hex]) });
+assert.throws(function() { new bson.ObjectID("zzzzzzzzzzzzzzzzzzzzzzzz") });
+assert.throws(function() { new bson.ObjectID("\u00e9" + oid_hex.slice(1)) });
+
+puts("ObjectID generateBatch");
+var batch = bson.ObjectID.generateBatch(3);
+assert.strictEqual(batch.length, 36);
+var first = batch.slice(0, 12).toString('binary'), second = batch.slice(12, 24).toString('binary');
+assert.strictEqual(first.slice(4, 9), second.slice(4, 9));
+assert.strictEqual((second.charCodeAt(11) - first.charCodeAt(11) + 256) % 256, 1);
+assert.strictEqual(bson.ObjectID.generateBatch(0).length, 0);
+assert.throws(function() { bson.ObjectID.generateBatch(-1) });
+assert.throws(function() { bson.ObjectID.generateBatch(16777217) }, RangeError);
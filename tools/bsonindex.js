@@ -0,0 +1,17 @@
+// Builds the index sidecar of a .bson file:
+//   node tools/bsonindex.js file.bson [field] [index]
+var bson = require('../lib/bson_ext');
+
+var args = process.argv.slice(2);
+if (args.length < 1) {
+  console.error('usage: bsonindex.js file.bson [field] [index]');
+  process.exit(1);
+}
+
+var options = {};
+if (args[1]) options.field = args[1];
+if (args[2]) options.index = args[2];
+
+var start = Date.now(),
+    result = bson.buildIndex(args[0], options);
+console.log(result.documents + ' documents, ' + result.keys + ' keys in ' + (Date.now() - start) + 'ms');